@@ -0,0 +1,261 @@
+
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include "Accumulator.h"
+#include "ZeroedArray.h"
+
+const uint16_t Accumulator::s_spread[TILE_SIZE] = {
+    0x000, 0x001, 0x004, 0x005, 0x010, 0x011, 0x014, 0x015,
+    0x040, 0x041, 0x044, 0x045, 0x050, 0x051, 0x054, 0x055,
+    0x100, 0x101, 0x104, 0x105, 0x110, 0x111, 0x114, 0x115,
+    0x140, 0x141, 0x144, 0x145, 0x150, 0x151, 0x154, 0x155,
+};
+
+Accumulator::Accumulator(int width, int height, Layout layout, Format format)
+    : m_width(width),
+      m_height(height),
+      m_layout(layout),
+      m_format(format),
+      m_tiles_x((width + TILE_SIZE - 1) >> TILE_SHIFT),
+      m_atomic(false),
+      m_saturated(false),
+      m_tile_locks(nullptr),
+      m_dirty_tiles(nullptr),
+      m_tile_sequences(nullptr) {
+
+    if (layout == LAYOUT_LINEAR) {
+        m_value_count = size_t(width)*height*3;
+    } else {
+        int tiles_y = (height + TILE_SIZE - 1) >> TILE_SHIFT;
+        m_value_count = size_t(m_tiles_x)*tiles_y*TILE_PIXELS*3;
+    }
+
+    m_data = map_zeroed(byte_count(), m_mapped_size);
+
+    // All zero, like the values.
+    m_dirty_tiles = new std::atomic<uint64_t>[dirty_word_count()]();
+    m_tile_sequences = new std::atomic<uint32_t>[tile_count()]();
+}
+
+Accumulator::~Accumulator() {
+    unmap_zeroed(m_data, m_mapped_size);
+    delete[] m_tile_locks;
+    delete[] m_dirty_tiles;
+    delete[] m_tile_sequences;
+}
+
+void Accumulator::share() {
+    if (is_fixed()) {
+        m_atomic = true;
+    } else if (m_tile_locks == nullptr) {
+        m_tile_locks = new std::atomic<bool>[tile_count()]();
+    }
+}
+
+void Accumulator::clear() {
+    memset(m_data, 0, byte_count());
+    clear_saturated();
+
+    // Every tile may have changed.
+    for (size_t i = 0; i < dirty_word_count(); i++) {
+        m_dirty_tiles[i].store(~uint64_t(0), std::memory_order_release);
+    }
+}
+
+void Accumulator::take_dirty_tiles(std::vector<uint64_t> &bits) const {
+    for (size_t i = 0; i < dirty_word_count(); i++) {
+        // Most words are clean, and reading doesn't take the cache line
+        // away from the worker.
+        if (m_dirty_tiles[i].load(std::memory_order_relaxed) != 0) {
+            bits[i] |= m_dirty_tiles[i].exchange(0, std::memory_order_acquire);
+        }
+    }
+}
+
+template <typename T>
+void Accumulator::set_sum_of(const std::vector<const Accumulator *> &images, size_t begin, size_t end) {
+    T *values = static_cast<T *>(m_data);
+
+    for (const Accumulator *image : images) {
+        if (image->saturated()) {
+            m_saturated.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    for (size_t i = begin; i < end; i++) {
+        T sum = 0;
+        for (const Accumulator *image : images) {
+            if (is_fixed()) {
+                sum = saturating_add(sum, load_value(static_cast<const T *>(image->m_data) + i));
+            } else {
+                sum += load_value(static_cast<const T *>(image->m_data) + i);
+            }
+        }
+        values[i] = sum;
+    }
+}
+
+void Accumulator::set_sum(const std::vector<const Accumulator *> &images, size_t begin, size_t end) {
+    switch (m_format) {
+        case FORMAT_FLOAT:
+            set_sum_of<float>(images, begin, end);
+            break;
+
+        case FORMAT_FIXED32:
+            set_sum_of<uint32_t>(images, begin, end);
+            break;
+
+        case FORMAT_FIXED64:
+            set_sum_of<uint64_t>(images, begin, end);
+            break;
+    }
+}
+
+template <typename T, typename S>
+void Accumulator::add_row_to(int y, S *row) const {
+    const T *values = static_cast<const T *>(m_data);
+
+    if (m_layout == LAYOUT_LINEAR) {
+        const T *src = values + size_t(y)*m_width*3;
+        for (int i = 0; i < m_width*3; i++) {
+            row[i] += load_value(src + i);
+        }
+        return;
+    }
+
+    const T *tile_row = values + size_t(y >> TILE_SHIFT)*m_tiles_x*TILE_PIXELS*3;
+    uint32_t morton_y = s_spread[y & (TILE_SIZE - 1)] << 1;
+
+    for (int x = 0; x < m_width; x++) {
+        const T *src = tile_row +
+            (size_t(x >> TILE_SHIFT)*TILE_PIXELS + (s_spread[x & (TILE_SIZE - 1)] | morton_y))*3;
+
+        row[0] += load_value(src + 0);
+        row[1] += load_value(src + 1);
+        row[2] += load_value(src + 2);
+        row += 3;
+    }
+}
+
+void Accumulator::add_rows_to(const std::vector<const Accumulator *> &images,
+        uint64_t *image, int y_begin, int y_end) {
+
+    for (int y = y_begin; y < y_end; y++) {
+        uint64_t *row = image + size_t(y - y_begin)*images[0]->m_width*3;
+
+        for (const Accumulator *accumulator : images) {
+            if (accumulator->m_format == FORMAT_FIXED32) {
+                accumulator->add_row_to<uint32_t>(y, row);
+            } else {
+                accumulator->add_row_to<uint64_t>(y, row);
+            }
+        }
+    }
+}
+
+void Accumulator::add_rows_to(const std::vector<const Accumulator *> &images,
+        float *image, int y_begin, int y_end) {
+
+    if (images.empty()) {
+        return;
+    }
+
+    int width = images[0]->m_width;
+
+    if (!images[0]->is_fixed()) {
+        for (int y = y_begin; y < y_end; y++) {
+            float *row = image + size_t(y - y_begin)*width*3;
+            for (const Accumulator *accumulator : images) {
+                accumulator->add_row_to<float>(y, row);
+            }
+        }
+        return;
+    }
+
+    // Sum exactly, then convert.
+    std::vector<uint64_t> fixed_row(width*3);
+    double unit = 1/images[0]->fixed_scale();
+    for (int y = y_begin; y < y_end; y++) {
+        std::fill(fixed_row.begin(), fixed_row.end(), 0);
+        add_rows_to(images, fixed_row.data(), y, y + 1);
+
+        float *row = image + size_t(y - y_begin)*width*3;
+        for (int i = 0; i < width*3; i++) {
+            row[i] += float(fixed_row[i]*unit);
+        }
+    }
+}
+
+template <typename T>
+void Accumulator::read_tile(size_t tile, T *values) const {
+    const T *src = static_cast<const T *>(m_data) + tile*TILE_PIXELS*3;
+    const std::atomic<uint32_t> &sequence = m_tile_sequences[tile];
+
+    while (true) {
+        uint32_t before = sequence.load(std::memory_order_acquire);
+        if ((before & 1) != 0) {
+            // The writer may be on our core.
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Acquire, so that the second look at the sequence number comes
+        // after these, and sees any write that they saw part of.
+        for (int i = 0; i < TILE_PIXELS*3; i++) {
+            values[i] = load_value(src + i, __ATOMIC_ACQUIRE);
+        }
+
+        // Nothing was written in between.
+        if (sequence.load(std::memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+template <typename T, typename S>
+void Accumulator::add_tile_values_to(size_t tile, S *pixels) const {
+    T values[TILE_PIXELS*3];
+    read_tile(tile, values);
+
+    for (int y = 0; y < TILE_SIZE; y++) {
+        uint32_t morton_y = s_spread[y] << 1;
+
+        for (int x = 0; x < TILE_SIZE; x++) {
+            const T *src = values + (s_spread[x] | morton_y)*3;
+
+            pixels[0] += src[0];
+            pixels[1] += src[1];
+            pixels[2] += src[2];
+            pixels += 3;
+        }
+    }
+}
+
+void Accumulator::add_tile_to(const std::vector<const Accumulator *> &images, size_t tile, float *pixels) {
+    if (images.empty()) {
+        return;
+    }
+
+    if (!images[0]->is_fixed()) {
+        for (const Accumulator *accumulator : images) {
+            accumulator->add_tile_values_to<float>(tile, pixels);
+        }
+        return;
+    }
+
+    // Sum exactly, then convert.
+    uint64_t fixed_pixels[TILE_PIXELS*3] = {};
+    for (const Accumulator *accumulator : images) {
+        if (accumulator->m_format == FORMAT_FIXED32) {
+            accumulator->add_tile_values_to<uint32_t>(tile, fixed_pixels);
+        } else {
+            accumulator->add_tile_values_to<uint64_t>(tile, fixed_pixels);
+        }
+    }
+
+    double unit = 1/images[0]->fixed_scale();
+    for (int i = 0; i < TILE_PIXELS*3; i++) {
+        pixels[i] += float(fixed_pixels[i]*unit);
+    }
+}
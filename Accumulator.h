@@ -0,0 +1,366 @@
+#ifndef ACCUMULATOR_H
+#define ACCUMULATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <limits>
+#include <thread>
+#include <vector>
+#include "Vec3.h"
+
+// Tiles are 2^TILE_SHIFT pixels on a side.
+static const int TILE_SHIFT = 5;
+static const int TILE_SIZE = 1 << TILE_SHIFT;
+static const int TILE_PIXELS = TILE_SIZE*TILE_SIZE;
+
+/**
+ * Sum of the photon colors that landed on each pixel, as RGB values.
+ *
+ * The rainbow is a long diagonal band, so in a row-major image (the
+ * default) nearly every hit is a cache and TLB miss. In the tiled layout,
+ * the image is cut into 32x32 tiles stored one after the other, with
+ * pixels in Morton (Z) order within a tile, so that nearby hits share
+ * cache lines and pages. That only pays off when the image doesn't fit in
+ * the cache, which "prism splat-bench" measures. Either way, use
+ * add_rows_to() to get row-major pixels.
+ *
+ * Values are floats by default. Float sums lose precision as they grow
+ * and depend on the order of the additions. The fixed-point formats round
+ * each photon to an integer number of units and add exactly, so sums are
+ * the same whatever the order, across threads or across shards. Fixed32
+ * holds 16 million full-brightness photons per pixel, then saturates
+ * (see saturated()); fixed64 never overflows in practice but takes twice
+ * the memory. Fixed32 units are coarse enough that rounding to the
+ * nearest would lose much of the dim ends of the spectrum, so it rounds
+ * up with the chance of the fraction instead, which is right on average.
+ *
+ * The buffer comes straight from mmap(), so it starts out zeroed without
+ * being touched, and is backed by transparent huge pages where available.
+ *
+ * Several workers can share an accumulator after calling share(). Fixed-
+ * point values are then added atomically. Float values need tile locks,
+ * so hits must be added with add_to_tile(), which takes the lock for
+ * each hit, or through a SplatBuffer, which takes it once per run of
+ * hits on that tile.
+ *
+ * Both also mark each tile they add to as dirty, so that the render loop
+ * can bring its sum of the workers' images up to date by re-adding only
+ * those tiles. Adding with add() doesn't mark anything.
+ *
+ * The render loop reads the images while workers add to them. Values are
+ * loaded and stored atomically (relaxed loads, release stores), which on
+ * x86 compiles to plain moves, so every value read is one that was
+ * written. add_to_tile() and a SplatBuffer also bump a tile's sequence
+ * number before and after each write to it, and read_tile() retries
+ * until the number is even and didn't change, so the tile it copies
+ * holds whole writes (a seqlock). Workers never wait for readers.
+ *
+ * Only the running sum of tiled images reads through read_tile(). A
+ * worker's own linear image is added to with add(), which skips the
+ * sequence numbers (they cost a tenth of the render time there), shared
+ * fixed-point images have several writers on a tile at once, and
+ * add_rows_to() reads value by value. Those reads, which include the
+ * images saved while rendering, are only coherent per value: a pixel can
+ * have part of a photon, and the image a mix of before and after a batch.
+ * Images read after the workers stop have every photon whole.
+ */
+class Accumulator {
+public:
+    enum Layout {
+        LAYOUT_LINEAR,
+        LAYOUT_TILED,
+    };
+
+    enum Format {
+        FORMAT_FLOAT,
+        FORMAT_FIXED32,
+        FORMAT_FIXED64,
+    };
+
+    Accumulator(int width, int height, Layout layout = LAYOUT_LINEAR, Format format = FORMAT_FLOAT);
+    ~Accumulator();
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int tiles_x() const { return m_tiles_x; }
+    int tiles_y() const { return (m_height + TILE_SIZE - 1) >> TILE_SHIFT; }
+    Layout layout() const { return m_layout; }
+    Format format() const { return m_format; }
+    bool is_fixed() const { return m_format != FORMAT_FLOAT; }
+
+    // Fixed-point units per unit of light.
+    double fixed_scale() const { return m_format == FORMAT_FIXED32 ? FIXED32_SCALE : FIXED64_SCALE; }
+
+    // Number of values (three per pixel, including tile padding), and
+    // bytes of memory they take.
+    size_t value_count() const { return m_value_count; }
+    size_t byte_count() const { return m_value_count*value_size(); }
+
+    // Set all pixels to zero.
+    void clear();
+
+    // Whether a fixed32 value reached the most that it holds, so that the
+    // image is clipped there. Reset by clear().
+    bool saturated() const { return m_saturated.load(std::memory_order_relaxed); }
+    void clear_saturated() { m_saturated.store(false, std::memory_order_relaxed); }
+
+    // Get ready for several workers to add to us at once.
+    void share();
+    bool has_tile_locks() const { return m_tile_locks != nullptr; }
+
+    // Add a color to a pixel. On a shared float accumulator, the caller
+    // must hold the pixel's tile lock.
+    void add(int x, int y, Vec3 const &rgb) {
+        add(pixel_index(x, y), rgb.r(), rgb.g(), rgb.b());
+    }
+
+    // Add a color to a pixel by its index.
+    void add(size_t pixel, float r, float g, float b) {
+        switch (m_format) {
+            case FORMAT_FLOAT:
+                add_as<FORMAT_FLOAT>(pixel, r, g, b);
+                break;
+
+            case FORMAT_FIXED32:
+                add_as<FORMAT_FIXED32>(pixel, r, g, b);
+                break;
+
+            case FORMAT_FIXED64:
+                add_as<FORMAT_FIXED64>(pixel, r, g, b);
+                break;
+        }
+    }
+
+    // Same, for code that's specialized for our format.
+    template <Format FORMAT>
+    void add_as(size_t pixel, float r, float g, float b) {
+        if (FORMAT == FORMAT_FLOAT) {
+            float *p = static_cast<float *>(m_data) + pixel*3;
+            store_value(p + 0, load_value(p + 0) + r);
+            store_value(p + 1, load_value(p + 1) + g);
+            store_value(p + 2, load_value(p + 2) + b);
+        } else if (FORMAT == FORMAT_FIXED32) {
+            add_fixed(static_cast<uint32_t *>(m_data) + pixel*3, FIXED32_SCALE, r, g, b);
+        } else {
+            add_fixed(static_cast<uint64_t *>(m_data) + pixel*3, FIXED64_SCALE, r, g, b);
+        }
+    }
+
+    // Add a color to a pixel by its index, as a write of its own to the
+    // pixel's tile: under the tile's lock if shared, and marking the tile
+    // dirty. A SplatBuffer does the same for a run of hits at a time.
+    void add_to_tile(size_t pixel, float r, float g, float b) {
+        size_t tile = tile_of(pixel);
+        if (m_tile_locks != nullptr) {
+            lock_tile(tile);
+        }
+        begin_tile_write(tile);
+        add(pixel, r, g, b);
+        end_tile_write(tile);
+        mark_dirty(tile);
+        if (m_tile_locks != nullptr) {
+            unlock_tile(tile);
+        }
+    }
+
+    // Index of a pixel in the buffer, in units of pixels.
+    size_t pixel_index(int x, int y) const {
+        return m_layout == LAYOUT_LINEAR ? pixel_index_as<LAYOUT_LINEAR>(x, y) :
+            pixel_index_as<LAYOUT_TILED>(x, y);
+    }
+
+    // Same, for code that's specialized for our layout.
+    template <Layout LAYOUT>
+    size_t pixel_index_as(int x, int y) const {
+        if (LAYOUT == LAYOUT_LINEAR) {
+            return size_t(y)*m_width + x;
+        }
+
+        size_t tile = size_t(y >> TILE_SHIFT)*m_tiles_x + (x >> TILE_SHIFT);
+        size_t morton = s_spread[x & (TILE_SIZE - 1)] | (s_spread[y & (TILE_SIZE - 1)] << 1);
+
+        return tile*TILE_PIXELS + morton;
+    }
+
+    // Tile of a pixel index. In the linear layout it's just a run of
+    // TILE_PIXELS pixels.
+    static size_t tile_of(size_t pixel) { return pixel >> (2*TILE_SHIFT); }
+    size_t tile_count() const { return (m_value_count/3 + TILE_PIXELS - 1)/TILE_PIXELS; }
+
+    // Spin until we have this tile to ourselves.
+    void lock_tile(size_t tile) {
+        std::atomic<bool> &lock = m_tile_locks[tile];
+        while (lock.exchange(true, std::memory_order_acquire)) {
+            while (lock.load(std::memory_order_relaxed)) {
+                // The holder may be on our core.
+                std::this_thread::yield();
+            }
+        }
+    }
+    void unlock_tile(size_t tile) {
+        m_tile_locks[tile].store(false, std::memory_order_release);
+    }
+
+    // Bracket a run of changes to a tile, for read_tile(). On a shared
+    // float accumulator, call them while holding the tile's lock.
+    void begin_tile_write(size_t tile) {
+        // The values' release stores keep them after this. No fence, since
+        // ThreadSanitizer doesn't understand them.
+        if (!m_atomic) {
+            std::atomic<uint32_t> &sequence = m_tile_sequences[tile];
+            sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    }
+    void end_tile_write(size_t tile) {
+        if (!m_atomic) {
+            std::atomic<uint32_t> &sequence = m_tile_sequences[tile];
+            sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    }
+
+    // Words of 64 dirty bits, one per tile.
+    size_t dirty_word_count() const { return (tile_count() + 63)/64; }
+
+    // Note that a tile changed. Call after changing it, so that whoever
+    // takes the bit also sees the change.
+    void mark_dirty(size_t tile) {
+        m_dirty_tiles[tile >> 6].fetch_or(uint64_t(1) << (tile & 63), std::memory_order_release);
+    }
+
+    // Or the bits of the tiles that changed since the last call into
+    // "bits" (dirty_word_count() words), and clear ours. A tile that
+    // changes while we're at it is marked again for next time.
+    void take_dirty_tiles(std::vector<uint64_t> &bits) const;
+
+    // Add tile "tile" of the images, which must be tiled and of the same
+    // format, to "pixels", a row-major TILE_SIZE x TILE_SIZE RGB block.
+    // Fixed-point images are summed exactly before converting.
+    static void add_tile_to(const std::vector<const Accumulator *> &images, size_t tile, float *pixels);
+
+    // Set values [begin, end) to the sum of the images' values. All must
+    // have our size, layout, and format. Fixed32 sums that don't fit
+    // saturate, and so do sums of saturated images.
+    void set_sum(const std::vector<const Accumulator *> &images, size_t begin, size_t end);
+
+    // Add rows [y_begin, y_end) of the images to "image", a row-major RGB
+    // image whose first row is y_begin. Fixed-point images are summed
+    // exactly before converting.
+    static void add_rows_to(const std::vector<const Accumulator *> &images,
+            float *image, int y_begin, int y_end);
+
+    // Same, but in fixed-point units, for fixed-point images only.
+    static void add_rows_to(const std::vector<const Accumulator *> &images,
+            uint64_t *image, int y_begin, int y_end);
+
+private:
+    static constexpr double FIXED32_SCALE = 1 << 18;
+    static constexpr double FIXED64_SCALE = 4294967296.0;
+
+    int m_width;
+    int m_height;
+    Layout m_layout;
+    Format m_format;
+    int m_tiles_x;
+    void *m_data;
+    size_t m_value_count;
+    size_t m_mapped_size;
+    bool m_atomic;
+    std::atomic<bool> m_saturated;
+    std::atomic<bool> *m_tile_locks;
+    // Taking them is how the render loop reads them, so they change under const.
+    mutable std::atomic<uint64_t> *m_dirty_tiles;
+    // Odd while a tile is being written.
+    std::atomic<uint32_t> *m_tile_sequences;
+
+    // Bits of each index within a tile spread out to the even bits. A
+    // table is quicker than the bit tricks.
+    static const uint16_t s_spread[TILE_SIZE];
+
+    size_t value_size() const { return m_format == FORMAT_FIXED64 ? 8 : 4; }
+
+    // Values that others may be reading or writing at the same time.
+    // Stores release, so that a reader who sees one also sees the tile's
+    // sequence number that came before it.
+    template <typename T>
+    static T load_value(const T *p, int order = __ATOMIC_RELAXED) {
+        T value;
+        __atomic_load(p, &value, order);
+        return value;
+    }
+    template <typename T>
+    static void store_value(T *p, T value) {
+        __atomic_store(p, &value, __ATOMIC_RELEASE);
+    }
+
+    // "a" plus "b", or the most that T holds if that doesn't fit. Only
+    // fixed32 ever gets there.
+    template <typename T>
+    T saturating_add(T a, T b) {
+        T sum = a + b;
+        if (sum < a) {
+            m_saturated.store(true, std::memory_order_relaxed);
+            return std::numeric_limits<T>::max();
+        }
+
+        return sum;
+    }
+
+    // Same, to a value that other workers are adding to.
+    template <typename T>
+    void saturating_add_atomic(T *p, T b) {
+        if (sizeof(T) == 8) {
+            __atomic_fetch_add(p, b, __ATOMIC_RELAXED);
+            return;
+        }
+
+        T a = load_value(p);
+        while (!__atomic_compare_exchange_n(p, &a, saturating_add(a, b), true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+
+            // "a" is now the latest value. Try again.
+        }
+    }
+
+    template <typename T>
+    void add_fixed(T *p, double scale, float r, float g, float b) {
+        // Round to the nearest unit, or for fixed32, up with the chance
+        // of the fraction. One random number for all three is still right
+        // on average for each.
+        double rounding = sizeof(T) == 4 ? rounding_rand() : 0.5;
+        T dr = T(r*scale + rounding);
+        T dg = T(g*scale + rounding);
+        T db = T(b*scale + rounding);
+
+        if (m_atomic) {
+            saturating_add_atomic(p + 0, dr);
+            saturating_add_atomic(p + 1, dg);
+            saturating_add_atomic(p + 2, db);
+        } else {
+            store_value(p + 0, saturating_add(load_value(p + 0), dr));
+            store_value(p + 1, saturating_add(load_value(p + 1), dg));
+            store_value(p + 2, saturating_add(load_value(p + 2), db));
+        }
+    }
+
+    // Add row "y" of our values to "row", in row-major order.
+    template <typename T, typename S>
+    void add_row_to(int y, S *row) const;
+
+    // Copy a tiled image's tile, as it was between two runs of writes.
+    template <typename T>
+    void read_tile(size_t tile, T *values) const;
+
+    // Add a snapshot of a tile to a row-major block.
+    template <typename T, typename S>
+    void add_tile_values_to(size_t tile, S *pixels) const;
+
+    template <typename T>
+    void set_sum_of(const std::vector<const Accumulator *> &images, size_t begin, size_t end);
+
+    // Not copyable.
+    Accumulator(const Accumulator &);
+    Accumulator &operator=(const Accumulator &);
+};
+
+#endif // ACCUMULATOR_H
@@ -0,0 +1,177 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include "AccumulatorFile.h"
+
+static const char MAGIC[8] = { 'P', 'R', 'I', 'S', 'M', 'A', 'C', 'C' };
+static const uint32_t VERSION = 2;
+
+// Bits of the header's flags.
+static const uint32_t FLAG_FILL_LIGHT = 1;
+
+/**
+ * What's at the start of an .acc file, in the machine's byte order.
+ */
+struct AccumulatorFileHeader {
+    char m_magic[8];
+    uint32_t m_version;
+    int32_t m_width;
+    int32_t m_height;
+    uint32_t m_flags;
+    int64_t m_photons;
+    double m_fixed_scale;
+};
+
+AccumulatorFile::AccumulatorFile()
+    : m_width(0), m_height(0), m_photons(0), m_fixed_scale(0), m_fill_light(false) {
+
+    // Nothing.
+}
+
+AccumulatorFile AccumulatorFile::sum_of(const std::vector<const Accumulator *> &images, int64_t photons,
+        bool fill_light) {
+
+    AccumulatorFile file;
+    const Accumulator *first = images[0];
+
+    file.m_width = first->width();
+    file.m_height = first->height();
+    file.m_photons = photons;
+    file.m_fill_light = fill_light;
+
+    size_t value_count = size_t(file.m_width)*file.m_height*3;
+    if (first->is_fixed()) {
+        file.m_fixed_scale = first->fixed_scale();
+        file.m_fixed_values.resize(value_count, 0);
+        Accumulator::add_rows_to(images, file.m_fixed_values.data(), 0, file.m_height);
+    } else {
+        file.m_float_values.resize(value_count, 0.0f);
+        Accumulator::add_rows_to(images, file.m_float_values.data(), 0, file.m_height);
+    }
+
+    return file;
+}
+
+bool AccumulatorFile::load(const std::string &pathname) {
+    FILE *f = fopen(pathname.c_str(), "rb");
+    if (f == nullptr) {
+        perror(pathname.c_str());
+        return false;
+    }
+
+    AccumulatorFileHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+            memcmp(header.m_magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            header.m_version != VERSION || header.m_width <= 0 || header.m_height <= 0) {
+
+        std::cerr << pathname << ": Not an accumulator file.\n";
+        fclose(f);
+        return false;
+    }
+
+    m_width = header.m_width;
+    m_height = header.m_height;
+    m_photons = header.m_photons;
+    m_fixed_scale = header.m_fixed_scale;
+    m_fill_light = (header.m_flags & FLAG_FILL_LIGHT) != 0;
+
+    size_t value_count = size_t(m_width)*m_height*3;
+    size_t read;
+    m_float_values.clear();
+    m_fixed_values.clear();
+    if (is_fixed()) {
+        m_fixed_values.resize(value_count);
+        read = fread(m_fixed_values.data(), sizeof(uint64_t), value_count, f);
+    } else {
+        m_float_values.resize(value_count);
+        read = fread(m_float_values.data(), sizeof(float), value_count, f);
+    }
+    fclose(f);
+
+    if (read != value_count) {
+        std::cerr << pathname << ": File is truncated.\n";
+        return false;
+    }
+
+    return true;
+}
+
+bool AccumulatorFile::save(const std::string &pathname) const {
+    FILE *f = fopen(pathname.c_str(), "wb");
+    if (f == nullptr) {
+        perror(pathname.c_str());
+        return false;
+    }
+
+    AccumulatorFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, MAGIC, sizeof(MAGIC));
+    header.m_version = VERSION;
+    header.m_width = m_width;
+    header.m_height = m_height;
+    header.m_photons = m_photons;
+    header.m_fixed_scale = m_fixed_scale;
+    header.m_flags = m_fill_light ? FLAG_FILL_LIGHT : 0;
+
+    bool success = fwrite(&header, sizeof(header), 1, f) == 1;
+    if (is_fixed()) {
+        success = success && fwrite(m_fixed_values.data(), sizeof(uint64_t),
+                m_fixed_values.size(), f) == m_fixed_values.size();
+    } else {
+        success = success && fwrite(m_float_values.data(), sizeof(float),
+                m_float_values.size(), f) == m_float_values.size();
+    }
+    success = fclose(f) == 0 && success;
+
+    if (!success) {
+        perror(pathname.c_str());
+    }
+
+    return success;
+}
+
+bool AccumulatorFile::add(const AccumulatorFile &other, const std::string &pathname) {
+    if (other.m_width != m_width || other.m_height != m_height) {
+        std::cerr << pathname << ": Image is " << other.m_width << "x" << other.m_height <<
+            ", expected " << m_width << "x" << m_height << ".\n";
+        return false;
+    }
+    if (other.m_fixed_scale != m_fixed_scale) {
+        std::cerr << pathname << ": Different accumulator format.\n";
+        return false;
+    }
+    if (other.m_fill_light != m_fill_light) {
+        std::cerr << pathname << ": " << (other.m_fill_light ? "Has" : "Doesn't have") <<
+            " the fill light, unlike the others.\n";
+        return false;
+    }
+
+    for (size_t i = 0; i < m_fixed_values.size(); i++) {
+        m_fixed_values[i] += other.m_fixed_values[i];
+    }
+    for (size_t i = 0; i < m_float_values.size(); i++) {
+        m_float_values[i] += other.m_float_values[i];
+    }
+    m_photons += other.m_photons;
+
+    return true;
+}
+
+void AccumulatorFile::add_to(Accumulator &image, double scale) const {
+    double fixed_unit = is_fixed() ? scale/m_fixed_scale : 0;
+
+    for (int y = 0; y < m_height; y++) {
+        for (int x = 0; x < m_width; x++) {
+            size_t i = (size_t(y)*m_width + x)*3;
+
+            if (is_fixed()) {
+                image.add(x, y, Vec3(m_fixed_values[i + 0]*fixed_unit,
+                            m_fixed_values[i + 1]*fixed_unit, m_fixed_values[i + 2]*fixed_unit));
+            } else {
+                image.add(x, y, Vec3(m_float_values[i + 0]*scale, m_float_values[i + 1]*scale,
+                            m_float_values[i + 2]*scale));
+            }
+        }
+    }
+}
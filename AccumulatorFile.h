@@ -0,0 +1,55 @@
+#ifndef ACCUMULATOR_FILE_H
+#define ACCUMULATOR_FILE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Accumulator.h"
+
+/**
+ * Summed accumulators saved to disk (".acc" files), so that a render can
+ * be split into shards with different seeds and merged later with
+ * "prism merge". Pixels are stored row-major. Float images are stored as
+ * floats; fixed-point images as 64-bit units, so that merging them is
+ * exact and gives the same bits in any order.
+ */
+class AccumulatorFile {
+public:
+    int m_width;
+    int m_height;
+
+    // Photons traced into the image.
+    int64_t m_photons;
+
+    // Fixed-point units per unit of light, or 0 for floats.
+    double m_fixed_scale;
+
+    // Whether the light from above on the prism is in the pixels, as it
+    // is when photons traced it. Files with and without it don't mix.
+    bool m_fill_light;
+
+    // Three values per pixel, only one of these is used.
+    std::vector<float> m_float_values;
+    std::vector<uint64_t> m_fixed_values;
+
+    AccumulatorFile();
+
+    // Sum of "images", which must all have the same size and format.
+    static AccumulatorFile sum_of(const std::vector<const Accumulator *> &images, int64_t photons,
+            bool fill_light);
+
+    bool is_fixed() const { return m_fixed_scale != 0; }
+
+    // Read or write the file. Prints the error and returns false on failure.
+    bool load(const std::string &pathname);
+    bool save(const std::string &pathname) const;
+
+    // Add another file's pixels and photons to ours. Prints the error and
+    // returns false if the two can't be added.
+    bool add(const AccumulatorFile &other, const std::string &pathname);
+
+    // Add our pixels to an accumulator of our size, times "scale".
+    void add_to(Accumulator &image, double scale = 1) const;
+};
+
+#endif // ACCUMULATOR_FILE_H
@@ -0,0 +1,157 @@
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include "BeamRender.h"
+#include "Tracer.h"
+
+// Spots across the slit's width and up its height.
+static const int SLIT_WIDTH_STEPS = 16;
+static const int SLIT_HEIGHT_STEPS = 1024;
+
+// Neighboring spots that took the same path land close together, but
+// beams that graze the paper spread out a lot. Landings farther apart
+// than this, in pixels, are taken to be split by an edge anyway.
+static const float MAX_SEGMENT_PIXELS = 256;
+
+// Add "rgb" to the pixel that a point lands in.
+static void add_point(Accumulator &image, float x, float y, Vec3 const &rgb) {
+    int px = (int) floor(x + 0.5);
+    int py = (int) floor(y + 0.5);
+
+    if (px >= 0 && py >= 0 && px < image.width() && py < image.height()) {
+        image.add(px, py, rgb);
+    }
+}
+
+// Spread "rgb" along the segment from (x0, y0) to (x1, y1), giving each
+// pixel the share of the segment's length that falls in it.
+static void add_segment(Accumulator &image, float x0, float y0, float x1, float y1, Vec3 const &rgb) {
+    // Pixel i covers [i, i + 1) once shifted by half a pixel.
+    x0 += 0.5;
+    y0 += 0.5;
+    x1 += 0.5;
+    y1 += 0.5;
+
+    float dx = x1 - x0;
+    float dy = y1 - y0;
+    int px = (int) floor(x0);
+    int py = (int) floor(y0);
+    int px_end = (int) floor(x1);
+    int py_end = (int) floor(y1);
+
+    // Walk the pixels the segment crosses, in order, with "t" going from
+    // 0 to 1 along it (Amanatides and Woo).
+    int step_x = dx > 0 ? 1 : -1;
+    int step_y = dy > 0 ? 1 : -1;
+    float t_delta_x = dx != 0 ? fabs(1/dx) : std::numeric_limits<float>::infinity();
+    float t_delta_y = dy != 0 ? fabs(1/dy) : std::numeric_limits<float>::infinity();
+    float t_max_x = dx != 0 ? ((dx > 0 ? px + 1 : px) - x0)/dx : std::numeric_limits<float>::infinity();
+    float t_max_y = dy != 0 ? ((dy > 0 ? py + 1 : py) - y0)/dy : std::numeric_limits<float>::infinity();
+
+    float t = 0;
+    while (true) {
+        bool last = px == px_end && py == py_end;
+        float t_next = last ? 1 : std::min(std::min(t_max_x, t_max_y), 1.0f);
+
+        if (px >= 0 && py >= 0 && px < image.width() && py < image.height()) {
+            image.add(px, py, rgb*(t_next - t));
+        }
+        if (last || t_next >= 1) {
+            break;
+        }
+
+        t = t_next;
+        if (t_max_x < t_max_y) {
+            t_max_x += t_delta_x;
+            px += step_x;
+        } else {
+            t_max_y += t_delta_y;
+            py += step_y;
+        }
+    }
+}
+
+// Index of the landing in "landings" that took the same path as "landing",
+// or -1.
+static int find_path(const std::vector<PathLanding> &landings, const PathLanding &landing) {
+    for (size_t i = 0; i < landings.size(); i++) {
+        if (landings[i].m_path == landing.m_path && landings[i].m_bounces == landing.m_bounces) {
+            return int(i);
+        }
+    }
+
+    return -1;
+}
+
+// Whether two landings are close enough to join.
+static bool joined(const PathLanding &a, const PathLanding &b) {
+    float dx = a.m_x - b.m_x;
+    float dy = a.m_y - b.m_y;
+
+    return dx*dx + dy*dy <= MAX_SEGMENT_PIXELS*MAX_SEGMENT_PIXELS;
+}
+
+// Render one wavelength into "image".
+static void render_wavelength(const Scene &scene, int wavelength, double light_per_spot,
+        Accumulator &image) {
+
+    Vec3 rgb = wavelength2rgb(wavelength)*light_per_spot;
+    std::vector<std::vector<PathLanding>> spots(SLIT_HEIGHT_STEPS);
+
+    for (int i = 0; i < SLIT_WIDTH_STEPS; i++) {
+        // Same slit as SlitLight, at the middle of each step.
+        float slit_y = (i + 0.5f)/SLIT_WIDTH_STEPS*0.002 - 0.05;
+
+        for (int j = 0; j < SLIT_HEIGHT_STEPS; j++) {
+            Vec3 target = Vec3(-0.6, slit_y, (j + 0.5f)/SLIT_HEIGHT_STEPS) + scene.m_offset;
+            spots[j].clear();
+            trace_paths(scene, scene.m_light_origin, target, wavelength, spots[j]);
+        }
+
+        // Half of each landing's light goes toward each neighbor up the
+        // slit, along a segment if the neighbor took the same path, or
+        // else to the landing's pixel.
+        for (int j = 0; j < SLIT_HEIGHT_STEPS; j++) {
+            for (const PathLanding &landing : spots[j]) {
+                if (j + 1 < SLIT_HEIGHT_STEPS) {
+                    int next = find_path(spots[j + 1], landing);
+                    if (next >= 0 && joined(landing, spots[j + 1][next])) {
+                        const PathLanding &other = spots[j + 1][next];
+                        add_segment(image, landing.m_x, landing.m_y, other.m_x, other.m_y,
+                                rgb*((landing.m_weight + other.m_weight)/2));
+                    } else {
+                        add_point(image, landing.m_x, landing.m_y, rgb*(landing.m_weight/2));
+                    }
+                } else {
+                    add_point(image, landing.m_x, landing.m_y, rgb*(landing.m_weight/2));
+                }
+
+                int previous = j > 0 ? find_path(spots[j - 1], landing) : -1;
+                if (previous < 0 || !joined(landing, spots[j - 1][previous])) {
+                    add_point(image, landing.m_x, landing.m_y, rgb*(landing.m_weight/2));
+                }
+            }
+        }
+    }
+}
+
+void render_beams(Scheduler &scheduler, const Scene &scene, int64_t photons,
+        const std::vector<Accumulator *> &images) {
+
+    // Photons pick a whole number of nanometers from 380 to 699.
+    const int first_wavelength = 380;
+    const int wavelength_count = 700 - 380;
+
+    // Light that a photon leaves, as in trace(), spread over the spots.
+    double slit_photons = scene.m_fill_light ? photons*(1 - FILL_LIGHT_SHARE) : photons;
+    double light_per_spot = 0.001*slit_photons/
+        (double(wavelength_count)*SLIT_WIDTH_STEPS*SLIT_HEIGHT_STEPS);
+
+    scheduler.parallel_for(0, wavelength_count, 1, [&](int64_t begin, int64_t end) {
+        Accumulator &image = *images[Scheduler::worker_index()];
+        for (int64_t i = begin; i < end; i++) {
+            render_wavelength(scene, first_wavelength + i, light_per_spot, image);
+        }
+    });
+}
@@ -0,0 +1,21 @@
+#ifndef BEAM_RENDER_H
+#define BEAM_RENDER_H
+
+#include <stdint.h>
+#include <vector>
+#include "Accumulator.h"
+#include "Scene.h"
+#include "Scheduler.h"
+
+// Render the slit light's beams without randomness, into the images
+// that "photons" photons would leave on average. The light from the
+// point through each spot on the slit, for each wavelength, is followed
+// down every path through the glass (see trace_paths()). Spots next to
+// each other up the slit land next to each other, so their landings are
+// joined into segments and each segment's light is spread over the
+// pixels by the length of it in each. Each worker adds to its own image
+// in "images". Only the slit light is rendered, not the fill light.
+void render_beams(Scheduler &scheduler, const Scene &scene, int64_t photons,
+        const std::vector<Accumulator *> &images);
+
+#endif // BEAM_RENDER_H
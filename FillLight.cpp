@@ -0,0 +1,34 @@
+
+#include "FillLight.h"
+#include "Timeline.h"
+#include "Tracer.h"
+
+// Rows per rendering task.
+static const int FILL_ROWS_PER_TASK = 16;
+
+FillLight::FillLight(Scheduler &scheduler, const Scene &scene, float brightness, uint64_t seed)
+    : m_width(scene.m_width),
+      m_image(scene.pixel_count()*3) {
+
+    scheduler.parallel_for(0, scene.m_height, FILL_ROWS_PER_TASK, [&](int64_t begin, int64_t end) {
+        TIMED_SCOPE("fill light");
+
+        float *rows = m_image.data() + begin*m_width*3;
+
+        // Same image whatever the thread count.
+        trace_fill_rows(scene, FILL_SAMPLES, seed + begin, rows, begin, end);
+
+        for (int64_t i = 0; i < (end - begin)*m_width*3; i++) {
+            rows[i] *= brightness;
+        }
+    });
+}
+
+void FillLight::add_rows_to(float *image, int y_begin, int y_end, int64_t photons) const {
+    const float *src = m_image.data() + size_t(y_begin)*m_width*3;
+    int64_t count = int64_t(y_end - y_begin)*m_width*3;
+
+    for (int64_t i = 0; i < count; i++) {
+        image[i] += src[i]*photons;
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef FILL_LIGHT_H
+#define FILL_LIGHT_H
+
+#include <stdint.h>
+#include "Scene.h"
+#include "Scheduler.h"
+#include "ZeroedArray.h"
+
+// View rays per pixel are FILL_SAMPLES squared.
+static const int FILL_SAMPLES = 4;
+
+/**
+ * The light from above that shows the prism itself, rendered once from
+ * the camera's side instead of by a tenth of the photons. Each pixel
+ * traces a few rays back toward the light and keeps the light per photon
+ * that would have reached it, so the result can be scaled to any photon
+ * count when it's added to the image, and doesn't get noisier or more
+ * expensive as photons are traced.
+ */
+class FillLight {
+public:
+    // Render it for this scene on the scheduler's workers, with
+    // "brightness" relative to the photon fill light.
+    FillLight(Scheduler &scheduler, const Scene &scene, float brightness, uint64_t seed);
+
+    // Add rows [y_begin, y_end) of the light for "photons" traced photons
+    // to "image", a row-major RGB image whose first row is y_begin.
+    void add_rows_to(float *image, int y_begin, int y_end, int64_t photons) const;
+
+private:
+    int m_width;
+    // Row-major RGB, per photon.
+    ZeroedArray<float> m_image;
+};
+
+#endif // FILL_LIGHT_H
@@ -0,0 +1,179 @@
+
+#include "FrameQueue.h"
+
+FrameQueue::FrameQueue(const Scene &base, const std::vector<SceneSweep> &sweeps,
+        int frame_count, int64_t photons, int worker_count, uint64_t seed,
+        Accumulator::Layout layout, Accumulator::Format format, bool shared)
+    : m_base(base),
+      m_sweeps(sweeps),
+      m_frame_count(frame_count),
+      m_photons(photons),
+      m_seed(seed),
+      m_layout(layout),
+      m_format(format),
+      m_shared(shared),
+      m_quit(false),
+      m_next_frame(0),
+      m_next_batch(0),
+      m_parked_lanes(0) {
+
+    for (Slot &slot : m_slots) {
+        slot.m_frame = -1;
+        slot.m_batch_count = 0;
+        slot.m_batches_done = 0;
+        slot.m_images = std::vector<std::atomic<Accumulator *>>(worker_count);
+        slot.m_image_frame = std::vector<std::atomic<int>>(worker_count);
+        for (int worker = 0; worker < worker_count; worker++) {
+            slot.m_images[worker] = nullptr;
+            slot.m_image_frame[worker] = -1;
+        }
+        slot.m_shared_image = nullptr;
+        slot.m_scratch = nullptr;
+    }
+}
+
+FrameQueue::~FrameQueue() {
+    for (Slot &slot : m_slots) {
+        for (std::atomic<Accumulator *> &image : slot.m_images) {
+            delete image.load();
+        }
+        delete slot.m_shared_image;
+        delete[] slot.m_scratch;
+        for (Accumulator *node_sum : slot.m_node_sums) {
+            delete node_sum;
+        }
+    }
+}
+
+FrameQueue::BatchStatus FrameQueue::next_batch(PhotonBatch &batch) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_quit || m_next_frame >= m_frame_count) {
+        return BATCH_DONE;
+    }
+
+    int slot_index = m_next_frame % FRAME_SLOTS;
+    Slot &slot = m_slots[slot_index];
+
+    if (slot.m_frame != m_next_frame) {
+        if (slot.m_frame != -1) {
+            // Still saving an earlier frame.
+            m_parked_lanes++;
+            return BATCH_WAIT;
+        }
+
+        // Claim the slot for the next frame.
+        slot.m_frame = m_next_frame;
+        slot.m_scene = scene_for_frame(m_base, m_sweeps, m_next_frame, m_frame_count);
+        slot.m_batch_count = m_photons < 0 ? -1 :
+            (m_photons + PHOTONS_PER_BATCH - 1)/PHOTONS_PER_BATCH;
+        slot.m_batches_done = 0;
+        m_next_batch = 0;
+
+        if (m_shared) {
+            if (slot.m_shared_image == nullptr) {
+                slot.m_shared_image = new Accumulator(slot.m_scene.m_width, slot.m_scene.m_height,
+                        m_layout, m_format);
+                slot.m_shared_image->share();
+            } else {
+                slot.m_shared_image->clear();
+            }
+        }
+    }
+
+    batch.m_slot = slot_index;
+    batch.m_frame = m_next_frame;
+    batch.m_batch = m_next_batch;
+    batch.m_photons = PHOTONS_PER_BATCH;
+    if (m_photons >= 0 && (m_next_batch + 1)*PHOTONS_PER_BATCH > m_photons) {
+        batch.m_photons = m_photons - m_next_batch*PHOTONS_PER_BATCH;
+    }
+    batch.m_seed = (m_seed*1000003 + m_next_frame)*1000003 + m_next_batch;
+    m_next_batch++;
+
+    if (slot.m_batch_count >= 0 && m_next_batch == slot.m_batch_count) {
+        // Handed out all of this frame, move on to the next.
+        m_next_frame++;
+    }
+
+    return BATCH_READY;
+}
+
+Accumulator *FrameQueue::image(const PhotonBatch &batch, int worker) {
+    Slot &slot = m_slots[batch.m_slot];
+
+    if (m_shared) {
+        return slot.m_shared_image;
+    }
+
+    // Only this worker writes its own image, so no lock. A new one is
+    // already zero, and its pages are first touched by this worker.
+    Accumulator *image = slot.m_images[worker].load(std::memory_order_relaxed);
+    if (image == nullptr) {
+        image = new Accumulator(slot.m_scene.m_width, slot.m_scene.m_height, m_layout, m_format);
+        slot.m_images[worker].store(image, std::memory_order_relaxed);
+    } else if (slot.m_image_frame[worker].load(std::memory_order_relaxed) != batch.m_frame) {
+        image->clear();
+    }
+
+    // Whoever sees the frame also sees the new or cleared image.
+    slot.m_image_frame[worker].store(batch.m_frame, std::memory_order_release);
+
+    return image;
+}
+
+bool FrameQueue::finish_batch(const PhotonBatch &batch) {
+    Slot &slot = m_slots[batch.m_slot];
+
+    int64_t done = ++slot.m_batches_done;
+
+    return slot.m_batch_count >= 0 && done == slot.m_batch_count;
+}
+
+std::vector<const Accumulator *> FrameQueue::worker_images(int slot_index) {
+    Slot &slot = m_slots[slot_index];
+
+    // For the slot's frame and shared image, which next_batch() sets.
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_shared) {
+        return std::vector<const Accumulator *>(1, slot.m_shared_image);
+    }
+
+    std::vector<const Accumulator *> images(slot.m_images.size(), nullptr);
+
+    for (size_t i = 0; i < slot.m_images.size(); i++) {
+        if (slot.m_image_frame[i].load(std::memory_order_acquire) == slot.m_frame) {
+            images[i] = slot.m_images[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    return images;
+}
+
+float *FrameQueue::scratch(int slot_index) {
+    Slot &slot = m_slots[slot_index];
+
+    if (slot.m_scratch == nullptr) {
+        slot.m_scratch = new float[slot.m_scene.pixel_count()*3];
+    }
+
+    return slot.m_scratch;
+}
+
+int FrameQueue::release_slot(int slot_index) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_slots[slot_index].m_frame = -1;
+
+    int parked_lanes = m_parked_lanes;
+    m_parked_lanes = 0;
+
+    return parked_lanes;
+}
+
+void FrameQueue::quit() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_quit = true;
+}
@@ -0,0 +1,126 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "Accumulator.h"
+#include "Scene.h"
+
+// Number of photons in a batch.
+static const int64_t PHOTONS_PER_BATCH = 100000;
+
+// Number of frames that can be in flight at once.
+static const int FRAME_SLOTS = 2;
+
+/**
+ * A batch of photons to trace for a frame.
+ */
+struct PhotonBatch {
+    int m_slot;
+    int m_frame;
+    int64_t m_batch;
+    int64_t m_photons;
+    uint64_t m_seed;
+};
+
+/**
+ * Hands out photon batches for a sequence of frames. Up to FRAME_SLOTS
+ * frames are in flight at once, so that workers can start on the next
+ * frame while the last batches of the previous one finish and it's saved.
+ * Each slot keeps one accumulator per worker, allocated on first use and
+ * recycled for later frames, or optionally one shared by all workers.
+ *
+ * Batches are traced by "lanes", chains of scheduler tasks that each take
+ * a batch, trace it, and queue themselves again. A lane that finds the
+ * next frame's slot still busy parks, and is handed back by release_slot().
+ */
+class FrameQueue {
+public:
+    enum BatchStatus {
+        // Got a batch.
+        BATCH_READY,
+        // The next frame's slot is busy. The lane is parked.
+        BATCH_WAIT,
+        // No more batches.
+        BATCH_DONE,
+    };
+
+    // Render "frame_count" frames of "photons" photons each (-1 means
+    // until quit() is called) with "worker_count" workers, into
+    // accumulators with this layout and format. If "shared", the workers
+    // share one accumulator per frame.
+    FrameQueue(const Scene &base, const std::vector<SceneSweep> &sweeps,
+            int frame_count, int64_t photons, int worker_count, uint64_t seed,
+            Accumulator::Layout layout, Accumulator::Format format, bool shared);
+    ~FrameQueue();
+
+    // Get the next batch to trace.
+    BatchStatus next_batch(PhotonBatch &batch);
+
+    // Image that "worker" should add the batch's photons to. It's cleared
+    // the first time the worker uses it for a frame.
+    Accumulator *image(const PhotonBatch &batch, int worker);
+
+    // Scene for the frame in this slot.
+    const Scene &scene(int slot) const { return m_slots[slot].m_scene; }
+
+    // Record that a batch is done. Returns whether it was the last one of
+    // its frame, in which case the caller must call release_slot() when
+    // it's done with the frame's images.
+    bool finish_batch(const PhotonBatch &batch);
+
+    // The image of each worker for the frame in this slot, or null for
+    // workers that haven't contributed. If shared, just the one image.
+    std::vector<const Accumulator *> worker_images(int slot);
+
+    // Buffer for tone-mapping the frame in this slot, kept across frames.
+    float *scratch(int slot);
+
+    // Per-NUMA-node sum buffers for this slot, kept across frames. The
+    // caller allocates them.
+    std::vector<Accumulator *> &node_sums(int slot) { return m_slots[slot].m_node_sums; }
+
+    // Free the slot for a later frame. Returns the number of parked lanes
+    // that the caller must restart.
+    int release_slot(int slot);
+
+    // Stop handing out batches.
+    void quit();
+
+private:
+    struct Slot {
+        // Frame in this slot, or -1 if free.
+        int m_frame;
+        Scene m_scene;
+        int64_t m_batch_count;
+        std::atomic<int64_t> m_batches_done;
+        // One per worker, and the frame each one holds. Set by each
+        // worker and read by the render loop, so atomic.
+        std::vector<std::atomic<Accumulator *>> m_images;
+        std::vector<std::atomic<int>> m_image_frame;
+        // For all workers, if shared.
+        Accumulator *m_shared_image;
+        float *m_scratch;
+        std::vector<Accumulator *> m_node_sums;
+    };
+
+    const Scene m_base;
+    const std::vector<SceneSweep> m_sweeps;
+    const int m_frame_count;
+    const int64_t m_photons;
+    const uint64_t m_seed;
+    const Accumulator::Layout m_layout;
+    const Accumulator::Format m_format;
+    const bool m_shared;
+
+    std::mutex m_mutex;
+    bool m_quit;
+    int m_next_frame;
+    int64_t m_next_batch;
+    int m_parked_lanes;
+    Slot m_slots[FRAME_SLOTS];
+};
+
+#endif // FRAME_QUEUE_H
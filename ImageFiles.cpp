@@ -0,0 +1,181 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+#include "ImageFiles.h"
+
+// Defined by stb_image_write, though not in its header.
+unsigned char *stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality);
+
+// Table of the CRC-32 of each byte.
+static std::vector<uint32_t> crc_table() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) != 0 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+
+    return table;
+}
+
+// CRC-32 of PNG chunks.
+static uint32_t crc32(const unsigned char *data, size_t size) {
+    // Encoding tasks may get here at once.
+    static const std::vector<uint32_t> table = crc_table();
+
+    uint32_t crc = ~uint32_t(0);
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static void put_u32(std::vector<unsigned char> &out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+// Append a chunk with its length and CRC.
+static void put_chunk(std::vector<unsigned char> &out, const char *type,
+        const unsigned char *data, size_t size) {
+
+    put_u32(out, uint32_t(size));
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_u32(out, crc32(out.data() + start, out.size() - start));
+}
+
+bool write_png16(const std::string &pathname, int width, int height, const uint16_t *rgb) {
+    // Each row is a filter byte and big-endian samples, with the "sub"
+    // filter (difference from the pixel to the left), which suits smooth
+    // images and is cheap.
+    size_t row_bytes = size_t(width)*6 + 1;
+    std::vector<unsigned char> filtered(row_bytes*height);
+    for (int y = 0; y < height; y++) {
+        unsigned char *row = filtered.data() + y*row_bytes;
+        const uint16_t *src = rgb + size_t(y)*width*3;
+
+        row[0] = 1;
+        for (int i = 0; i < width*3; i++) {
+            row[1 + i*2] = src[i] >> 8;
+            row[2 + i*2] = src[i] & 0xFF;
+        }
+        // Right to left, so that we subtract the unfiltered bytes.
+        for (size_t i = row_bytes - 1; i > 6; i--) {
+            row[i] -= row[i - 6];
+        }
+    }
+
+    int compressed_size;
+    unsigned char *compressed = stbi_zlib_compress(filtered.data(), int(filtered.size()), &compressed_size, 8);
+    if (compressed == nullptr) {
+        std::cerr << "Cannot compress " << pathname << "\n";
+        return false;
+    }
+
+    static const unsigned char SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    std::vector<unsigned char> png(SIGNATURE, SIGNATURE + 8);
+
+    // 16 bits per sample, RGB, no interlacing.
+    std::vector<unsigned char> header;
+    put_u32(header, width);
+    put_u32(header, height);
+    header.push_back(16);
+    header.push_back(2);
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    put_chunk(png, "IHDR", header.data(), header.size());
+    put_chunk(png, "IDAT", compressed, compressed_size);
+    put_chunk(png, "IEND", nullptr, 0);
+    free(compressed);
+
+    FILE *f = fopen(pathname.c_str(), "wb");
+    bool success = f != nullptr && fwrite(png.data(), 1, png.size(), f) == png.size();
+    if (f != nullptr && fclose(f) != 0) {
+        success = false;
+    }
+    if (!success) {
+        std::cerr << "Cannot write " << pathname << "\n";
+    }
+
+    return success;
+}
+
+bool write_pfm(const std::string &pathname, int width, int height, const float *rgb) {
+    FILE *f = fopen(pathname.c_str(), "wb");
+    if (f == nullptr) {
+        std::cerr << "Cannot write " << pathname << "\n";
+        return false;
+    }
+
+    // A negative scale means little-endian.
+    uint16_t one = 1;
+    bool little_endian = *reinterpret_cast<unsigned char *>(&one) == 1;
+    fprintf(f, "PF\n%d %d\n%s\n", width, height, little_endian ? "-1.0" : "1.0");
+
+    size_t count = size_t(width)*height*3;
+    bool success = fwrite(rgb, sizeof(float), count, f) == count;
+    if (fclose(f) != 0) {
+        success = false;
+    }
+    if (!success) {
+        std::cerr << "Cannot write " << pathname << "\n";
+    }
+
+    return success;
+}
+
+bool read_pfm(const std::string &pathname, int &width, int &height, std::vector<float> &rgb) {
+    FILE *f = fopen(pathname.c_str(), "rb");
+    if (f == nullptr) {
+        std::cerr << "Cannot read " << pathname << "\n";
+        return false;
+    }
+
+    // The header is three whitespace-separated lines, then one byte of it.
+    char magic[3];
+    float scale;
+    if (fscanf(f, "%2s %d %d %f", magic, &width, &height, &scale) != 4 || std::string(magic) != "PF" ||
+            width <= 0 || height <= 0 || fgetc(f) == EOF) {
+
+        std::cerr << pathname << " isn't an RGB PFM file.\n";
+        fclose(f);
+        return false;
+    }
+
+    size_t row_count = size_t(width)*3;
+    rgb.resize(row_count*height);
+    bool success = true;
+    for (int y = height - 1; y >= 0 && success; y--) {
+        success = fread(rgb.data() + y*row_count, sizeof(float), row_count, f) == row_count;
+    }
+    fclose(f);
+    if (!success) {
+        std::cerr << pathname << " is too short.\n";
+        return false;
+    }
+
+    // Swap bytes if the file's order isn't ours.
+    uint16_t one = 1;
+    bool little_endian = *reinterpret_cast<unsigned char *>(&one) == 1;
+    if ((scale < 0) != little_endian) {
+        for (float &value : rgb) {
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            bits = __builtin_bswap32(bits);
+            memcpy(&value, &bits, sizeof(bits));
+        }
+    }
+
+    return true;
+}
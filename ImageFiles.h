@@ -0,0 +1,22 @@
+#ifndef IMAGE_FILES_H
+#define IMAGE_FILES_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Image formats that stb_image_write doesn't do. All return whether
+// successful, and print the error if not.
+
+// Write a 16-bit RGB PNG. "rgb" is row-major, in the machine's byte
+// order, with 0xFFFF for full brightness.
+bool write_png16(const std::string &pathname, int width, int height, const uint16_t *rgb);
+
+// Write a PFM (portable float map) of linear RGB. "rgb" is row-major,
+// bottom row first, as PFM files store them.
+bool write_pfm(const std::string &pathname, int width, int height, const float *rgb);
+
+// Read an RGB PFM file into "rgb", row-major, top row first.
+bool read_pfm(const std::string &pathname, int &width, int &height, std::vector<float> &rgb);
+
+#endif // IMAGE_FILES_H
@@ -0,0 +1,222 @@
+
+#include <string.h>
+#include <unistd.h>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "PerfCounters.h"
+
+static const char *COUNTER_NAMES[] = {
+    "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses", "dTLB-misses",
+};
+
+static const char *PHASE_NAMES[] = { "rng", "intersect", "glass", "splat" };
+
+// Every thread's counters, kept until we exit.
+static std::mutex g_all_mutex;
+static std::vector<PerfCounters *> g_all;
+
+static thread_local PerfCounters *t_counters;
+
+#ifdef __linux__
+// Event type and config of each counter.
+static const uint32_t COUNTER_TYPES[] = {
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HW_CACHE,
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HW_CACHE,
+};
+
+static const uint64_t COUNTER_CONFIGS[] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+};
+#endif
+
+PerfCounters::PerfCounters()
+    : m_photons(0),
+      m_can_read_fast(false) {
+
+    memset(m_totals, 0, sizeof(m_totals));
+    memset(m_phase_counts, 0, sizeof(m_phase_counts));
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        m_fds[i] = -1;
+#ifdef __linux__
+        m_pages[i] = nullptr;
+#endif
+    }
+}
+
+void PerfCounters::open() {
+#ifdef __linux__
+    // One group, so that the kernel counts them all at once or not at
+    // all, led by the first one it lets us have.
+    int leader = -1;
+    bool all_mapped = true;
+
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = COUNTER_TYPES[i];
+        attr.config = COUNTER_CONFIGS[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // This thread, on any CPU.
+        m_fds[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+        if (m_fds[i] < 0) {
+            continue;
+        }
+        if (leader < 0) {
+            leader = m_fds[i];
+        }
+
+        void *page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, m_fds[i], 0);
+        if (page == MAP_FAILED) {
+            all_mapped = false;
+        } else {
+            m_pages[i] = static_cast<perf_event_mmap_page *>(page);
+            all_mapped = all_mapped && m_pages[i]->cap_user_rdpmc;
+        }
+    }
+
+#ifdef PERF_RDPMC
+    m_can_read_fast = leader >= 0 && all_mapped;
+#else
+    (void) all_mapped;
+#endif
+#endif
+}
+
+PerfCounters &PerfCounters::for_this_thread() {
+    if (t_counters == nullptr) {
+        t_counters = new PerfCounters();
+        t_counters->open();
+
+        std::lock_guard<std::mutex> lock(g_all_mutex);
+        g_all.push_back(t_counters);
+    }
+
+    return *t_counters;
+}
+
+std::vector<PerfCounters *> PerfCounters::all() {
+    std::lock_guard<std::mutex> lock(g_all_mutex);
+    return g_all;
+}
+
+bool PerfCounters::is_open() const {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (has(i)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void PerfCounters::read(uint64_t counts[COUNTER_COUNT]) const {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        counts[i] = 0;
+        if (has(i) && ::read(m_fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) {
+            counts[i] = 0;
+        }
+    }
+}
+
+const char *PerfCounters::counter_name(int counter) {
+    return COUNTER_NAMES[counter];
+}
+
+const char *PerfCounters::phase_name(int phase) {
+    return PHASE_NAMES[phase];
+}
+
+// Print a row of counts per million photons, with dashes for counters
+// we don't have.
+static void print_row(const char *name, const uint64_t counts[COUNTER_COUNT], const PerfCounters &first,
+        int64_t photons) {
+
+    std::cout << std::left << std::setw(11) << name << std::right;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        std::cout << std::setw(15);
+        if (first.has(i)) {
+            std::cout << std::fixed << std::setprecision(0) << counts[i]*1e6/photons;
+        } else {
+            std::cout << "-";
+        }
+    }
+    std::cout << "\n";
+}
+
+void print_perf_counters() {
+    std::vector<PerfCounters *> counters = PerfCounters::all();
+
+    // All threads open the same counters.
+    if (counters.empty() || !counters[0]->is_open()) {
+        std::cout << "No hardware counters. The machine may not have any, or the kernel may not let us\n"
+            "have them (see /proc/sys/kernel/perf_event_paranoid).\n";
+        return;
+    }
+    const PerfCounters &first = *counters[0];
+
+    int64_t photons = 0;
+    uint64_t totals[COUNTER_COUNT] = {};
+    uint64_t phase_counts[PHASE_COUNT][COUNTER_COUNT] = {};
+    for (const PerfCounters *thread : counters) {
+        photons += thread->m_photons;
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            totals[i] += thread->m_totals[i];
+            for (int phase = 0; phase < PHASE_COUNT; phase++) {
+                phase_counts[phase][i] += thread->m_phase_counts[phase][i];
+            }
+        }
+    }
+    if (photons == 0) {
+        return;
+    }
+
+    if (!first.can_read_fast()) {
+        std::cout << "Can't read the counters without a system call here, so only totals.\n";
+    }
+    std::cout << "Per million photons:\n";
+    std::cout << "Phase      ";
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        std::cout << std::setw(15) << PerfCounters::counter_name(i);
+    }
+    std::cout << "\n";
+
+    if (first.can_read_fast()) {
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            print_row(PerfCounters::phase_name(phase), phase_counts[phase], first, photons);
+        }
+    }
+    print_row("total", totals, first, photons);
+
+    if (first.has(COUNTER_CYCLES) && first.has(COUNTER_INSTRUCTIONS)) {
+        for (size_t thread = 0; thread < counters.size(); thread++) {
+            const PerfCounters &c = *counters[thread];
+            if (c.m_photons == 0) {
+                continue;
+            }
+
+            std::cout << "Thread " << thread << ": " << c.m_photons << " photons, " <<
+                std::setprecision(0) << double(c.m_totals[COUNTER_CYCLES])/c.m_photons << " cycles and " <<
+                double(c.m_totals[COUNTER_INSTRUCTIONS])/c.m_photons << " instructions per photon, " <<
+                std::setprecision(2) << double(c.m_totals[COUNTER_INSTRUCTIONS])/c.m_totals[COUNTER_CYCLES] <<
+                " per cycle.\n";
+        }
+    }
+    std::cout.unsetf(std::ios::fixed);
+}
@@ -0,0 +1,194 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+// We can read the counters without a system call.
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+#define PERF_RDPMC
+#endif
+
+// Hardware events that we count.
+enum PerfCounter {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTER_COUNT,
+};
+
+// Parts of the tracing loop that the counts are split into.
+enum TracePhase {
+    // Emitting photons.
+    PHASE_RNG,
+    // Finding the closest side of the prism or the paper.
+    PHASE_INTERSECT,
+    // Bounce limits, Russian roulette, and refracting or reflecting.
+    PHASE_GLASS,
+    // Adding landed photons to the image.
+    PHASE_SPLAT,
+    PHASE_COUNT,
+};
+
+/**
+ * Hardware performance counters of one thread, from perf_event_open(),
+ * for our own code only (not the kernel's), and what they've counted in
+ * the tracing loop. Counters that the machine or the kernel won't give us
+ * (see /proc/sys/kernel/perf_event_paranoid) stay closed.
+ *
+ * Reading the counters through the kernel takes a system call, which is
+ * fine once per batch but not per bounce. On x86 the kernel lets us read
+ * them directly with rdpmc, so the counts can be split by phase.
+ */
+class PerfCounters {
+public:
+    // Photons traced with the counters on, and the counts over those
+    // batches, in all and by phase.
+    int64_t m_photons;
+    uint64_t m_totals[COUNTER_COUNT];
+    uint64_t m_phase_counts[PHASE_COUNT][COUNTER_COUNT];
+
+    // Counters of the calling thread, opened the first time it asks.
+    static PerfCounters &for_this_thread();
+
+    // Counters of every thread that has asked so far.
+    static std::vector<PerfCounters *> all();
+
+    bool has(int counter) const { return m_fds[counter] >= 0; }
+    bool is_open() const;
+
+    // Whether read_fast() works, so that we can count by phase.
+    bool can_read_fast() const { return m_can_read_fast; }
+
+    // Current counts, through the kernel. Closed counters read zero.
+    void read(uint64_t counts[COUNTER_COUNT]) const;
+
+    // Same, without a system call.
+    void read_fast(uint64_t counts[COUNTER_COUNT]) const {
+#ifdef PERF_RDPMC
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            counts[i] = m_pages[i] != nullptr ? read_page(m_pages[i]) : 0;
+        }
+#else
+        read(counts);
+#endif
+    }
+
+    static const char *counter_name(int counter);
+    static const char *phase_name(int phase);
+
+private:
+    int m_fds[COUNTER_COUNT];
+    bool m_can_read_fast;
+#ifdef __linux__
+    // The kernel's page for each counter, for rdpmc.
+    perf_event_mmap_page *m_pages[COUNTER_COUNT];
+#endif
+
+    PerfCounters();
+    void open();
+
+#ifdef PERF_RDPMC
+    // The counter's value, following the kernel's recipe in
+    // linux/perf_event.h. The page's lock changes if we're preempted.
+    static uint64_t read_page(const volatile perf_event_mmap_page *page) {
+        uint32_t seq;
+        uint64_t count;
+
+        do {
+            seq = page->lock;
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+            uint32_t index = page->index;
+            count = page->offset;
+            if (page->cap_user_rdpmc && index != 0) {
+                int shift = 64 - page->pmc_width;
+                uint64_t pmc = __builtin_ia32_rdpmc(index - 1);
+                count += uint64_t(int64_t(pmc << shift) >> shift);
+            }
+
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        } while (page->lock != seq);
+
+        return count;
+    }
+#endif
+};
+
+// Profilers are policies of the tracing loop, told when it moves from one
+// phase to the next and when a batch is done.
+
+/**
+ * Counts nothing, and compiles to nothing.
+ */
+struct NoProfiler {
+    void enter(TracePhase) {
+        // Nothing.
+    }
+
+    void finish(int64_t) {
+        // Nothing.
+    }
+};
+
+/**
+ * Adds the thread's counts over the batch to its PerfCounters, and over
+ * each phase if they can be read quickly.
+ */
+class CounterProfiler {
+public:
+    CounterProfiler()
+        : m_counters(PerfCounters::for_this_thread()),
+          m_fast(m_counters.can_read_fast()),
+          m_phase(PHASE_RNG) {
+
+        m_counters.read(m_start);
+        if (m_fast) {
+            m_counters.read_fast(m_last);
+        }
+    }
+
+    void enter(TracePhase phase) {
+        if (m_fast) {
+            uint64_t now[COUNTER_COUNT];
+            m_counters.read_fast(now);
+
+            for (int i = 0; i < COUNTER_COUNT; i++) {
+                m_counters.m_phase_counts[m_phase][i] += now[i] - m_last[i];
+                m_last[i] = now[i];
+            }
+        }
+        m_phase = phase;
+    }
+
+    void finish(int64_t photons) {
+        enter(m_phase);
+
+        uint64_t end[COUNTER_COUNT];
+        m_counters.read(end);
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            m_counters.m_totals[i] += end[i] - m_start[i];
+        }
+        m_counters.m_photons += photons;
+    }
+
+private:
+    PerfCounters &m_counters;
+    bool m_fast;
+    TracePhase m_phase;
+    uint64_t m_start[COUNTER_COUNT];
+    uint64_t m_last[COUNTER_COUNT];
+};
+
+// Print the counts of all threads per million photons, by phase if we
+// have them, and each thread's cycles and instructions per photon.
+void print_perf_counters();
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,127 @@
+
+#include <math.h>
+#include <algorithm>
+#include "PhotonMap.h"
+
+// Share of each pass's new photons that a pixel keeps, which sets how
+// quickly radii shrink. Hachisuka et al. suggest 0.7.
+static const float PHOTON_MAP_ALPHA = 0.7;
+
+// Rows per gathering task.
+static const int GATHER_ROWS_PER_TASK = 8;
+
+PhotonMap::PhotonMap(int width, int height, float radius)
+    : m_width(width),
+      m_height(height) {
+
+    radius = std::min(std::max(radius, MIN_PHOTON_RADIUS), MAX_PHOTON_RADIUS);
+    m_pixels.resize(size_t(width)*height, Pixel{radius, 0, {0, 0, 0}});
+
+    // Cells cover the image and the margin that hits are kept in. They're
+    // at least a pixel, so that the grid is no bigger than the image.
+    m_cell_size = radius;
+    m_cells_x = int(ceil((width + 2*MAX_PHOTON_RADIUS)/m_cell_size));
+    m_cells_y = int(ceil((height + 2*MAX_PHOTON_RADIUS)/m_cell_size));
+}
+
+int PhotonMap::cell_x(float x) const {
+    return std::min(std::max(int((x + MAX_PHOTON_RADIUS)/m_cell_size), 0), m_cells_x - 1);
+}
+
+int PhotonMap::cell_y(float y) const {
+    return std::min(std::max(int((y + MAX_PHOTON_RADIUS)/m_cell_size), 0), m_cells_y - 1);
+}
+
+void PhotonMap::add_pass(Scheduler &scheduler, const std::vector<std::vector<PhotonHit>> &hits) {
+    // Counting sort by cell.
+    m_cell_start.assign(size_t(m_cells_x)*m_cells_y + 1, 0);
+    size_t hit_count = 0;
+    for (const std::vector<PhotonHit> &list : hits) {
+        for (const PhotonHit &hit : list) {
+            m_cell_start[size_t(cell_y(hit.m_y))*m_cells_x + cell_x(hit.m_x) + 1]++;
+        }
+        hit_count += list.size();
+    }
+    for (size_t cell = 1; cell < m_cell_start.size(); cell++) {
+        m_cell_start[cell] += m_cell_start[cell - 1];
+    }
+
+    m_sorted.resize(hit_count);
+    std::vector<uint32_t> next(m_cell_start.begin(), m_cell_start.end() - 1);
+    for (const std::vector<PhotonHit> &list : hits) {
+        for (const PhotonHit &hit : list) {
+            m_sorted[next[size_t(cell_y(hit.m_y))*m_cells_x + cell_x(hit.m_x)]++] = hit;
+        }
+    }
+
+    scheduler.parallel_for(0, m_height, GATHER_ROWS_PER_TASK, [this](int64_t begin, int64_t end) {
+        gather_rows(begin, end);
+    });
+}
+
+void PhotonMap::gather_rows(int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; y++) {
+        Pixel *pixel = &m_pixels[size_t(y)*m_width];
+
+        for (int x = 0; x < m_width; x++, pixel++) {
+            float radius = pixel->m_radius;
+            float radius2 = radius*radius;
+
+            int found = 0;
+            double flux[3] = {0, 0, 0};
+
+            int cx_end = cell_x(x + radius);
+            int cy_end = cell_y(y + radius);
+            for (int cy = cell_y(y - radius); cy <= cy_end; cy++) {
+                for (int cx = cell_x(x - radius); cx <= cx_end; cx++) {
+                    size_t cell = size_t(cy)*m_cells_x + cx;
+                    const PhotonHit *hit = m_sorted.data() + m_cell_start[cell];
+                    const PhotonHit *hit_end = m_sorted.data() + m_cell_start[cell + 1];
+
+                    for (; hit < hit_end; hit++) {
+                        float dx = hit->m_x - x;
+                        float dy = hit->m_y - y;
+                        if (dx*dx + dy*dy <= radius2) {
+                            found++;
+                            flux[0] += hit->m_rgb[0];
+                            flux[1] += hit->m_rgb[1];
+                            flux[2] += hit->m_rgb[2];
+                        }
+                    }
+                }
+            }
+
+            if (found == 0) {
+                continue;
+            }
+
+            // Keep only some of the new photons, and shrink the radius so
+            // that the density stays the same. The light scales with the
+            // area.
+            double count = pixel->m_count + PHOTON_MAP_ALPHA*found;
+            double area_ratio = count/(pixel->m_count + found);
+            pixel->m_radius = radius*sqrt(area_ratio);
+            pixel->m_count = count;
+            for (int i = 0; i < 3; i++) {
+                pixel->m_flux[i] = (pixel->m_flux[i] + flux[i])*area_ratio;
+            }
+        }
+    }
+}
+
+void PhotonMap::estimate(Scheduler &scheduler, Accumulator &image) const {
+    image.clear();
+
+    scheduler.parallel_for(0, m_height, GATHER_ROWS_PER_TASK, [this, &image](int64_t begin, int64_t end) {
+        for (int y = begin; y < end; y++) {
+            const Pixel *pixel = &m_pixels[size_t(y)*m_width];
+
+            for (int x = 0; x < m_width; x++, pixel++) {
+                // Light per unit of area, and pixels are one unit.
+                float scale = 1/(M_PI*pixel->m_radius*pixel->m_radius);
+                image.add(x, y, Vec3(pixel->m_flux[0]*scale, pixel->m_flux[1]*scale,
+                            pixel->m_flux[2]*scale));
+            }
+        }
+    });
+}
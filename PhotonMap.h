@@ -0,0 +1,71 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include <stdint.h>
+#include <vector>
+#include "Accumulator.h"
+#include "Scheduler.h"
+#include "Tracer.h"
+
+// Photons traced between gathers.
+static const int64_t PHOTONS_PER_PASS = 1000000;
+
+// Smallest starting radius, in pixels. Smaller ones would find almost no
+// photons, and grid cells are never smaller than this.
+static const float MIN_PHOTON_RADIUS = 1;
+
+/**
+ * Progressive photon mapping on the paper. Instead of each photon only
+ * counting for the pixel it lands in, each pixel counts the photons that
+ * land within some radius of it and divides by the area. Photons are
+ * traced in passes. After each pass, the hits are sorted into a grid of
+ * cells the size of the largest radius, at most one per pixel, each pixel
+ * gathers the ones near it, and pixels that found any shrink their radius
+ * a little, so that the image starts out smooth and gets sharper as
+ * photons come in without ever being biased by an old, larger radius
+ * (Hachisuka et al., 2008).
+ */
+class PhotonMap {
+public:
+    // Start each pixel with a radius of "radius" pixels, from
+    // MIN_PHOTON_RADIUS to MAX_PHOTON_RADIUS.
+    PhotonMap(int width, int height, float radius);
+
+    // Gather a pass of hits (all the workers' lists) into the pixels.
+    void add_pass(Scheduler &scheduler, const std::vector<std::vector<PhotonHit>> &hits);
+
+    // Set "image" (our size) to the current estimate, in the same units
+    // as an image that photons were added to directly.
+    void estimate(Scheduler &scheduler, Accumulator &image) const;
+
+private:
+    // A pixel's gathering radius, the number of photons it has kept
+    // (after shrinking), and the light they bring. The count is a double
+    // because a float stops counting single photons past 2^24.
+    struct Pixel {
+        float m_radius;
+        double m_count;
+        double m_flux[3];
+    };
+
+    int m_width;
+    int m_height;
+    std::vector<Pixel> m_pixels;
+
+    // Grid of cells that hits are sorted into for each pass.
+    float m_cell_size;
+    int m_cells_x;
+    int m_cells_y;
+    // Index in m_sorted of each cell's first hit, plus one at the end.
+    std::vector<uint32_t> m_cell_start;
+    std::vector<PhotonHit> m_sorted;
+
+    // Cell of a position, clamped to the grid.
+    int cell_x(float x) const;
+    int cell_y(float y) const;
+
+    // Gather the pass's hits into rows [y_begin, y_end).
+    void gather_rows(int y_begin, int y_end);
+};
+
+#endif // PHOTON_MAP_H
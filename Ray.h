@@ -5,25 +5,29 @@
 
 /**
  * A ray with an origin, direction, and wavelength in nanometers. The direction
- * is not necessarily of unit length.
+ * is not necessarily of unit length. The weight is the fraction of the
+ * photon's light that the ray carries, which scales what it leaves on the
+ * paper. Eight 4-byte fields, so rays pack into 32 bytes.
  */
 class Ray {
 public:
     Vec3 m_origin;
     Vec3 m_direction;
     int m_wavelength;
+    float m_weight;
 
     Ray() {
         // Nothing.
     }
-    Ray(const Vec3 &origin, const Vec3 &direction, int wavelength)
-        : m_origin(origin), m_direction(direction), m_wavelength(wavelength) {
+    Ray(const Vec3 &origin, const Vec3 &direction, int wavelength, float weight = 1)
+        : m_origin(origin), m_direction(direction), m_wavelength(wavelength), m_weight(weight) {
 
         // Nothing.
     }
     const Vec3 &origin() const { return m_origin; }
     const Vec3 &direction() const { return m_direction; }
     int wavelength() const { return m_wavelength; }
+    float weight() const { return m_weight; }
     Vec3 point_at(float t) const { return m_origin + t*m_direction; }
 };
 
@@ -0,0 +1,442 @@
+
+#include <math.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "AccumulatorFile.h"
+#include "BeamRender.h"
+#include "FrameQueue.h"
+#include "PhotonMap.h"
+#include "Regression.h"
+#include "Scheduler.h"
+#include "Tracer.h"
+
+// Size and photons of every scene. Small enough to run in seconds and for
+// the references to be kept with the code, big enough that the rainbow is
+// well past the noise.
+static const int REGRESSION_WIDTH = 110;
+static const int REGRESSION_HEIGHT = 140;
+static const int64_t REGRESSION_PHOTONS = 2000000;
+static const uint64_t REGRESSION_SEED = 1;
+
+// References of lights that can't be rendered without randomness get this
+// many times the photons, with another seed, so that they're mostly what
+// the scene converges to.
+static const int64_t REFERENCE_PHOTON_FACTOR = 16;
+static const uint64_t REFERENCE_SEED = 2;
+
+/**
+ * A scene to check, as changes from the default scene, and the
+ * accumulators to trace it into.
+ */
+struct RegressionCase {
+    const char *m_name;
+    const char *m_light;
+    const char *m_reflections;
+    bool m_fill_light;
+    Accumulator::Layout m_layout;
+    Accumulator::Format m_format;
+    // Name of the reference it should converge to. The case with the same
+    // name describes the reference's scene.
+    const char *m_reference;
+    // Lowest PSNR of the image and its regions against the reference when
+    // the reference was made. Photon noise, and for references without
+    // randomness, how the beams are drawn, keep it from being higher.
+    double m_psnr;
+};
+
+static const RegressionCase CASES[] = {
+    { "slit", "slit", "stochastic", true,
+        Accumulator::LAYOUT_TILED, Accumulator::FORMAT_FIXED64, "slit", 43 },
+    { "slit-linear", "slit", "stochastic", true,
+        Accumulator::LAYOUT_LINEAR, Accumulator::FORMAT_FLOAT, "slit", 43 },
+    { "slit-none", "slit", "none", true,
+        Accumulator::LAYOUT_TILED, Accumulator::FORMAT_FIXED64, "slit-none", 41 },
+    { "slit-weighted", "slit", "weighted", true,
+        Accumulator::LAYOUT_TILED, Accumulator::FORMAT_FIXED64, "slit-weighted", 41 },
+    { "slit-split", "slit", "split", true,
+        Accumulator::LAYOUT_TILED, Accumulator::FORMAT_FIXED64, "slit", 43 },
+    { "slit-no-fill", "slit", "stochastic", false,
+        Accumulator::LAYOUT_TILED, Accumulator::FORMAT_FIXED64, "slit-no-fill", 31 },
+    { "slit-no-fill-linear", "slit", "stochastic", false,
+        Accumulator::LAYOUT_LINEAR, Accumulator::FORMAT_FLOAT, "slit-no-fill", 31 },
+    { "slit-split-no-fill", "slit", "split", false,
+        Accumulator::LAYOUT_TILED, Accumulator::FORMAT_FIXED64, "slit-no-fill", 30.5 },
+    { "ring", "ring", "stochastic", true,
+        Accumulator::LAYOUT_TILED, Accumulator::FORMAT_FIXED64, "ring", 39 },
+    { "halo", "halo", "stochastic", true,
+        Accumulator::LAYOUT_TILED, Accumulator::FORMAT_FIXED64, "halo", 19.5 },
+};
+
+// Parts of the image that are checked separately, since an error in the
+// rainbow would be lost in the background's pixel count.
+enum Region {
+    // Bright pixels outside the prism.
+    REGION_BEAM,
+    REGION_PRISM,
+    REGION_BACKGROUND,
+    REGION_COUNT,
+};
+
+static const char *REGION_NAMES[] = { "beam", "prism", "background" };
+
+// Pixels brighter than this share of the brightest are in the beam.
+static const double BEAM_THRESHOLD = 0.01;
+
+// Most that the light in the beam or the prism may differ from the
+// reference's. The background has too little light to say.
+static const double MAX_BIAS = 0.02;
+
+/**
+ * How far an image is from its reference over some pixels.
+ */
+struct ImageError {
+    double m_squared_error;
+    double m_sum;
+    double m_reference_sum;
+    int64_t m_count;
+
+    ImageError() : m_squared_error(0), m_sum(0), m_reference_sum(0), m_count(0) {
+        // Nothing.
+    }
+
+    // Peak signal-to-noise ratio, in dB, or infinity if exact.
+    double psnr(double peak) const {
+        double mse = m_count > 0 ? m_squared_error/m_count : 0;
+        return mse > 0 ? 10*log10(peak*peak/mse) : INFINITY;
+    }
+
+    // Relative difference in total light.
+    double bias() const {
+        return m_reference_sum > 0 ? m_sum/m_reference_sum - 1 : 0;
+    }
+};
+
+// Trace the scene's photons into images of this layout and format, one
+// per worker, and return their sum. With fixed-point images the sum is the
+// same for any number of threads.
+static AccumulatorFile render_case(Scheduler &scheduler, const Scene &scene, Accumulator::Layout layout,
+        Accumulator::Format format, int64_t photons, uint64_t seed, double &seconds) {
+
+    TraceFunction tracer = tracer_for(scene, layout, false);
+    std::vector<Accumulator *> images;
+    for (int i = 0; i < scheduler.worker_count(); i++) {
+        images.push_back(new Accumulator(scene.m_width, scene.m_height, layout, format));
+    }
+
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    scheduler.parallel_for(0, photons, PHOTONS_PER_BATCH, [&](int64_t begin, int64_t end) {
+        TraceStats stats = TraceStats();
+        tracer(scene, *images[Scheduler::worker_index()], end - begin,
+                seed*1000003 + begin/PHOTONS_PER_BATCH, stats);
+    });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    seconds = elapsed.count();
+
+    AccumulatorFile file = AccumulatorFile::sum_of(
+            std::vector<const Accumulator *>(images.begin(), images.end()), photons,
+            scene.m_fill_light);
+    for (Accumulator *image : images) {
+        delete image;
+    }
+
+    return file;
+}
+
+// Render the light that the scene converges to: without randomness for
+// the slit light, as "prism reference" does, or else with many photons.
+// The fill light from the camera's side only follows the light that
+// refracts, so it's not exact enough to check the photons against.
+static AccumulatorFile render_reference(Scheduler &scheduler, const Scene &scene) {
+    if (scene.m_light != Scene::LIGHT_SLIT || scene.m_fill_light) {
+        double seconds;
+        return render_case(scheduler, scene, Accumulator::LAYOUT_LINEAR, Accumulator::FORMAT_FLOAT,
+                REGRESSION_PHOTONS*REFERENCE_PHOTON_FACTOR, REFERENCE_SEED, seconds);
+    }
+
+    std::vector<Accumulator *> images;
+    for (int i = 0; i < scheduler.worker_count(); i++) {
+        images.push_back(new Accumulator(scene.m_width, scene.m_height, Accumulator::LAYOUT_LINEAR));
+    }
+    render_beams(scheduler, scene, REGRESSION_PHOTONS, images);
+
+    AccumulatorFile file = AccumulatorFile::sum_of(
+            std::vector<const Accumulator *>(images.begin(), images.end()), REGRESSION_PHOTONS, false);
+    for (Accumulator *image : images) {
+        delete image;
+    }
+
+    return file;
+}
+
+// The file's values as floats, times "scale".
+static std::vector<float> values_of(const AccumulatorFile &file, double scale) {
+    std::vector<float> values(file.is_fixed() ? file.m_fixed_values.size() : file.m_float_values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = file.is_fixed() ? float(file.m_fixed_values[i]*scale/file.m_fixed_scale) :
+            float(file.m_float_values[i]*scale);
+    }
+
+    return values;
+}
+
+// Whether the paper under pixel x, y is inside the prism.
+static bool in_prism(const Scene &scene, int x, int y) {
+    Vec3 p = paper_point(scene, x, y);
+
+    return (p - scene.m_p0).dot(scene.m_n01) < 0 &&
+        (p - scene.m_p1).dot(scene.m_n12) < 0 &&
+        (p - scene.m_p2).dot(scene.m_n20) < 0;
+}
+
+// Compare the image with the reference, scaled to the image's photons,
+// overall and by region. Returns the peak of the reference.
+static double compare(const Scene &scene, const AccumulatorFile &image, const AccumulatorFile &reference,
+        ImageError &total, ImageError *regions) {
+
+    std::vector<float> values = values_of(image, 1);
+    std::vector<float> reference_values = values_of(reference, double(image.m_photons)/reference.m_photons);
+
+    double peak = 0;
+    for (float value : reference_values) {
+        peak = std::max(peak, double(value));
+    }
+
+    for (int y = 0; y < scene.m_height; y++) {
+        for (int x = 0; x < scene.m_width; x++) {
+            size_t i = (size_t(y)*scene.m_width + x)*3;
+
+            Region region;
+            if (in_prism(scene, x, y)) {
+                region = REGION_PRISM;
+            } else if (std::max(std::max(reference_values[i], reference_values[i + 1]),
+                        reference_values[i + 2]) > BEAM_THRESHOLD*peak) {
+
+                region = REGION_BEAM;
+            } else {
+                region = REGION_BACKGROUND;
+            }
+
+            for (int c = 0; c < 3; c++) {
+                double error = double(values[i + c]) - reference_values[i + c];
+                for (ImageError *e : { &total, &regions[region] }) {
+                    e->m_squared_error += error*error;
+                    e->m_sum += values[i + c];
+                    e->m_reference_sum += reference_values[i + c];
+                    e->m_count++;
+                }
+            }
+        }
+    }
+
+    return peak;
+}
+
+// The red value of a one-pixel fixed32 image, in units.
+static uint64_t fixed32_red(const Accumulator &image) {
+    uint64_t rgb[3] = {0, 0, 0};
+    Accumulator::add_rows_to(std::vector<const Accumulator *>(1, &image), rgb, 0, 1);
+
+    return rgb[0];
+}
+
+// Check that fixed32 values saturate instead of wrapping, alone, shared,
+// and summed, and that rounding keeps light too dim for one unit.
+static bool check_fixed32() {
+    const uint64_t most = UINT32_MAX;
+    bool ok = true;
+
+    Accumulator lone(1, 1, Accumulator::LAYOUT_LINEAR, Accumulator::FORMAT_FIXED32);
+    Accumulator shared(1, 1, Accumulator::LAYOUT_LINEAR, Accumulator::FORMAT_FIXED32);
+    shared.share();
+    double unit = 1/lone.fixed_scale();
+
+    // Just under the limit, then past it.
+    init_rand(REGRESSION_SEED);
+    for (Accumulator *image : { &lone, &shared }) {
+        image->add(0, float(most*unit*0.99), 0, 0);
+        ok = ok && !image->saturated() && fixed32_red(*image) < most;
+        image->add(0, float(most*unit*0.02), 0, 0);
+        ok = ok && image->saturated() && fixed32_red(*image) == most;
+    }
+
+    // Two values that fit, but not their sum.
+    Accumulator half(1, 1, Accumulator::LAYOUT_LINEAR, Accumulator::FORMAT_FIXED32);
+    half.add(0, float(most*unit*0.6), 0, 0);
+    Accumulator sum(1, 1, Accumulator::LAYOUT_LINEAR, Accumulator::FORMAT_FIXED32);
+    sum.set_sum(std::vector<const Accumulator *>(2, &half), 0, 3);
+    ok = ok && !half.saturated() && sum.saturated() && fixed32_red(sum) == most;
+
+    // A third of a unit at a time, which rounding to the nearest would
+    // lose entirely. The binomial's spread is 0.5%.
+    Accumulator dim(1, 1, Accumulator::LAYOUT_LINEAR, Accumulator::FORMAT_FIXED32);
+    const int dim_count = 100000;
+    for (int i = 0; i < dim_count; i++) {
+        dim.add(0, float(unit/3), 0, 0);
+    }
+    double dim_error = fixed32_red(dim)/(dim_count/3.0) - 1;
+    ok = ok && fabs(dim_error) < 0.02;
+
+    std::cout << "fixed32 saturation and rounding" << (ok ? "" : "  FAILED") << "\n";
+
+    return ok;
+}
+
+// Check the photon map with the smallest radius, and with one below it,
+// which it raises rather than making a grid of tiny cells.
+static bool check_photon_map(Scheduler &scheduler) {
+    const int size = 100;
+    const int hit_count = 10000;
+    bool ok = true;
+
+    for (float radius : { MIN_PHOTON_RADIUS, 0.001f }) {
+        PhotonMap photon_map(size, size, radius);
+
+        // All on the center pixel.
+        std::vector<std::vector<PhotonHit>> hits(1,
+                std::vector<PhotonHit>(hit_count, PhotonHit{size/2, size/2, {1, 0, 0}}));
+        photon_map.add_pass(scheduler, hits);
+
+        Accumulator image(size, size);
+        photon_map.estimate(scheduler, image);
+        std::vector<float> row(size*3, 0.0f);
+        Accumulator::add_rows_to(std::vector<const Accumulator *>(1, &image), row.data(),
+                size/2, size/2 + 1);
+
+        // The pixel keeps 0.7 of the light and of the area, which leaves
+        // the light over the starting radius's area.
+        double expected = hit_count/(M_PI*MIN_PHOTON_RADIUS*MIN_PHOTON_RADIUS);
+        ok = ok && fabs(row[(size/2)*3]/expected - 1) < 1e-3;
+    }
+
+    std::cout << "photon map with small radii" << (ok ? "" : "  FAILED") << "\n";
+
+    return ok;
+}
+
+// Light caught inside the prism that bounces past 21 times. Beam renders
+// join landings that share a path number, which landings that bounced a
+// different number of times did when the number kept only the last 21
+// bounces.
+static bool check_deep_paths() {
+    Scene scene;
+    scene.m_reflections = Scene::REFLECTIONS_SPLIT;
+    scene.m_max_bounces = 64;
+
+    // In glass this dense, light running parallel to a side hits the
+    // others past the critical angle and turns parallel to another side,
+    // so it stays inside the prism, sinking slowly until it reaches the
+    // paper.
+    scene.m_cauchy_b = 2.5;
+    scene.m_cauchy_c = 0;
+    Vec3 along = (scene.m_p2 - scene.m_p0).unit();
+    std::vector<PathLanding> landings;
+    for (int i = 0; i < 20; i++) {
+        for (float way : { 1.0f, -1.0f }) {
+            Vec3 origin = scene.m_center + Vec3(0, 0, 0.305f + i*0.05f);
+            trace_paths(scene, origin, origin + along*way + Vec3(0, 0, -0.1f), 550, landings);
+        }
+    }
+
+    // Each landing bounced a different number of times or went the other
+    // way around, so no two should share a path number.
+    int deep_count = 0;
+    bool ok = true;
+    for (size_t i = 0; i < landings.size(); i++) {
+        if (landings[i].m_bounces > 21) {
+            deep_count++;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (landings[i].m_path == landings[j].m_path) {
+                ok = false;
+            }
+        }
+    }
+    ok = ok && deep_count > 0;
+
+    std::cout << "beam paths past 21 bounces" << (ok ? "" : "  FAILED") << "\n";
+
+    return ok;
+}
+
+bool run_regression(const std::string &directory, bool update, double tolerance, int thread_count) {
+    Scheduler scheduler(thread_count);
+    bool passed = check_fixed32();
+    passed = check_photon_map(scheduler) && passed;
+    passed = check_deep_paths() && passed;
+
+    if (update) {
+        // Fine if it's already there.
+        mkdir(directory.c_str(), 0777);
+    }
+
+    std::cout << std::left << std::setw(20) << "scene" << std::right << std::setw(12) << "photons/s" <<
+        std::setw(10) << "PSNR";
+    for (int region = 0; region < REGION_COUNT; region++) {
+        std::cout << std::setw(12) << REGION_NAMES[region] << std::setw(10) << "bias";
+    }
+    std::cout << "\n";
+
+    for (const RegressionCase &test : CASES) {
+        Scene scene;
+        scene.m_width = REGRESSION_WIDTH;
+        scene.m_height = REGRESSION_HEIGHT;
+        scene.set_light(test.m_light);
+        scene.set_reflections(test.m_reflections);
+        scene.m_fill_light = test.m_fill_light;
+        scene.update();
+
+        std::string pathname = directory + "/" + test.m_reference + ".acc";
+        if (update && std::string(test.m_name) == test.m_reference) {
+            if (!render_reference(scheduler, scene).save(pathname)) {
+                passed = false;
+            }
+        }
+
+        double seconds;
+        AccumulatorFile image = render_case(scheduler, scene, test.m_layout, test.m_format,
+                REGRESSION_PHOTONS, REGRESSION_SEED, seconds);
+
+        std::cout << std::left << std::setw(20) << test.m_name << std::right << std::setw(12) <<
+            std::setprecision(3) << REGRESSION_PHOTONS/seconds;
+
+        AccumulatorFile reference;
+        if (!reference.load(pathname)) {
+            passed = false;
+            continue;
+        }
+        if (reference.m_width != image.m_width || reference.m_height != image.m_height ||
+                reference.m_fill_light != image.m_fill_light) {
+
+            std::cout << "  reference has a different size or light\n";
+            passed = false;
+            continue;
+        }
+
+        ImageError total;
+        ImageError regions[REGION_COUNT];
+        double peak = compare(scene, image, reference, total, regions);
+
+        double min_psnr = test.m_psnr - tolerance;
+        bool ok = total.psnr(peak) >= min_psnr;
+        std::cout << std::fixed << std::setprecision(1) << std::setw(10) << total.psnr(peak);
+        for (int region = 0; region < REGION_COUNT; region++) {
+            ok = ok && regions[region].psnr(peak) >= min_psnr;
+            if (region != REGION_BACKGROUND) {
+                ok = ok && fabs(regions[region].bias()) <= MAX_BIAS;
+            }
+            std::cout << std::setw(12) << regions[region].psnr(peak) <<
+                std::setw(9) << std::showpos << 100*regions[region].bias() << std::noshowpos << "%";
+        }
+        std::cout << std::defaultfloat;
+        std::cout << (ok ? "" : "  FAILED") << "\n";
+
+        passed = passed && ok;
+    }
+
+    std::cout << (passed ? "All scenes match.\n" : "Some scenes don't match.\n");
+
+    return passed;
+}
@@ -0,0 +1,16 @@
+#ifndef REGRESSION_H
+#define REGRESSION_H
+
+#include <string>
+
+// Render a fixed set of small scenes, each with a fixed photon count and
+// seed, and compare them with the reference accumulator files in
+// "directory", which hold the light each scene converges to. If "update",
+// render those files first. Prints the error of each, overall and in the
+// rainbow, prism, and background regions, and its photons per second.
+// Returns whether they all exist, none is more than "tolerance" dB of PSNR
+// under the scene's usual, and the rainbow and prism have the
+// reference's light within a few percent.
+bool run_regression(const std::string &directory, bool update, double tolerance, int thread_count);
+
+#endif // REGRESSION_H
@@ -0,0 +1,66 @@
+
+#include <string.h>
+#include <algorithm>
+#include "RunningSum.h"
+#include "Timeline.h"
+
+// Tiles per task.
+static const int64_t TILE_GRAIN = 16;
+
+RunningSum::RunningSum(int width, int height)
+    : m_width(width),
+      m_height(height),
+      m_tiles_x((width + TILE_SIZE - 1) >> TILE_SHIFT),
+      m_values(size_t(width)*height*3),
+      m_lit(size_t(m_tiles_x)*((height + TILE_SIZE - 1) >> TILE_SHIFT)),
+      m_saturated(false),
+      m_dirty((m_lit.size() + 63)/64) {
+
+    // Nothing.
+}
+
+int RunningSum::update(Scheduler &scheduler, const std::vector<const Accumulator *> &images) {
+    std::fill(m_dirty.begin(), m_dirty.end(), 0);
+    for (const Accumulator *image : images) {
+        image->take_dirty_tiles(m_dirty);
+        m_saturated = m_saturated || image->saturated();
+    }
+
+    std::vector<size_t> tiles;
+    for (size_t i = 0; i < m_dirty.size(); i++) {
+        for (uint64_t bits = m_dirty[i]; bits != 0; bits &= bits - 1) {
+            size_t tile = i*64 + __builtin_ctzll(bits);
+            if (tile < m_lit.size()) {
+                tiles.push_back(tile);
+            }
+        }
+    }
+
+    scheduler.parallel_for(0, tiles.size(), TILE_GRAIN, [&](int64_t begin, int64_t end) {
+        TIMED_SCOPE("re-add tiles");
+
+        float pixels[TILE_PIXELS*3];
+        for (int64_t i = begin; i < end; i++) {
+            size_t tile = tiles[i];
+            memset(pixels, 0, sizeof(pixels));
+            Accumulator::add_tile_to(images, tile, pixels);
+
+            // Copy the part that's in the image.
+            int x0 = int(tile % m_tiles_x)*TILE_SIZE;
+            int y0 = int(tile / m_tiles_x)*TILE_SIZE;
+            int width = std::min(TILE_SIZE, m_width - x0);
+            int height = std::min(TILE_SIZE, m_height - y0);
+            bool lit = false;
+            for (int y = 0; y < height; y++) {
+                const float *src = pixels + y*TILE_SIZE*3;
+                memcpy(m_values.data() + (size_t(y0 + y)*m_width + x0)*3, src, width*3*sizeof(float));
+                for (int j = 0; j < width*3; j++) {
+                    lit = lit || src[j] != 0;
+                }
+            }
+            m_lit[tile] = m_lit[tile] || lit;
+        }
+    });
+
+    return int(tiles.size());
+}
@@ -0,0 +1,52 @@
+#ifndef RUNNING_SUM_H
+#define RUNNING_SUM_H
+
+#include <stdint.h>
+#include <vector>
+#include "Accumulator.h"
+#include "Scheduler.h"
+#include "ZeroedArray.h"
+
+/**
+ * Row-major RGB sum of the workers' tiled images, for the render loop.
+ * Adding up every worker's whole image for each update reads all of
+ * them, though most tiles haven't changed since the last time, and many
+ * (away from the beams) never get any light. This re-adds only the tiles
+ * that the workers marked dirty since the last update.
+ */
+class RunningSum {
+public:
+    RunningSum(int width, int height);
+
+    // Bring the tiles that changed in any of the images up to date. The
+    // images must be tiled, of our size, and of the same format, and the
+    // same ones from one call to the next, though new ones (still empty)
+    // can be added. Returns the number of tiles re-added.
+    int update(Scheduler &scheduler, const std::vector<const Accumulator *> &images);
+
+    // Row-major RGB.
+    const float *values() const { return m_values.data(); }
+
+    // Whether any of the images had reached the most that fixed32 holds,
+    // as of the last update.
+    bool saturated() const { return m_saturated; }
+
+    // Whether the tile at this tile row and column has had any light.
+    bool is_lit(int tile_y, int tile_x) const { return m_lit[size_t(tile_y)*m_tiles_x + tile_x]; }
+
+private:
+    int m_width;
+    int m_height;
+    int m_tiles_x;
+    ZeroedArray<float> m_values;
+    std::vector<char> m_lit;
+    bool m_saturated;
+    // Dirty bits taken from the images, one per tile.
+    std::vector<uint64_t> m_dirty;
+
+    // Not copyable.
+    RunningSum(const RunningSum &);
+    RunningSum &operator=(const RunningSum &);
+};
+
+#endif // RUNNING_SUM_H
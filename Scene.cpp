@@ -0,0 +1,152 @@
+
+#include <sstream>
+#include "Scene.h"
+
+static const float PRISM_WIDTH = 0.3;
+
+// Where the slit is, before the offset. It's 0.002 wide in Y and goes
+// from Z = 0 to 1.
+static const float SLIT_X = -0.6;
+static const float SLIT_Y = -0.049;
+
+// Normalized 2D normal vector to two vertices.
+static Vec3 get_2d_normal(Vec3 const &p1, Vec3 const &p2) {
+    Vec3 v = p2 - p1;
+
+    return Vec3(-v.y(), v.x(), 0).unit();
+}
+
+// Rotate p counter-clockwise around center in the XY plane.
+static Vec3 rotate_2d(Vec3 const &p, Vec3 const &center, float degrees) {
+    float a = degrees*M_PI/180;
+    float c = cos(a);
+    float s = sin(a);
+    Vec3 v = p - center;
+
+    return center + Vec3(v.x()*c - v.y()*s, v.x()*s + v.y()*c, v.z());
+}
+
+Scene::Scene()
+    : m_width(3300),
+      m_height(4200),
+      m_light_angle(0),
+      m_prism_rotation(0),
+      m_dispersion(10),
+      m_light(LIGHT_SLIT),
+      m_fill_light(true),
+      m_reflections(REFLECTIONS_STOCHASTIC),
+      m_max_bounces(64),
+      m_roulette_bounces(4) {
+
+    update();
+}
+
+void Scene::update() {
+    m_p0 = Vec3(-PRISM_WIDTH/2, 0, 0);
+    m_p1 = Vec3(0, PRISM_WIDTH*sqrt(3)/2, 0);
+    m_p2 = Vec3(PRISM_WIDTH/2, 0, 0);
+
+    // Center prism at 0,0,0.
+    m_offset = Vec3(0, -m_p1.y()*0.4, 0);
+    m_p0 += m_offset;
+    m_p1 += m_offset;
+    m_p2 += m_offset;
+    m_center = (m_p0 + m_p1 + m_p2)/3;
+
+    if (m_prism_rotation != 0) {
+        m_p0 = rotate_2d(m_p0, m_center, m_prism_rotation);
+        m_p1 = rotate_2d(m_p1, m_center, m_prism_rotation);
+        m_p2 = rotate_2d(m_p2, m_center, m_prism_rotation);
+    }
+
+    m_n01 = get_2d_normal(m_p0, m_p1);
+    m_n12 = get_2d_normal(m_p1, m_p2);
+    m_n20 = get_2d_normal(m_p2, m_p0);
+
+    m_light_origin = Vec3(-10, -3.2, 1) + m_offset;
+    if (m_light_angle != 0) {
+        m_light_origin = rotate_2d(m_light_origin, Vec3(SLIT_X, SLIT_Y, 0) + m_offset, m_light_angle);
+    }
+
+    // Borosilicate glass BK7.
+    float B = 1.5046;
+    float C = 0.00420;
+
+    // Widen rainbow, renormalize B so that green doesn't move.
+    float new_C = C*m_dispersion;
+    m_cauchy_b = B + C/(.540*.540) - new_C/(.540*.540);
+    m_cauchy_c = new_C;
+}
+
+bool Scene::set(const std::string &name, float value) {
+    if (name == "light_angle") {
+        m_light_angle = value;
+    } else if (name == "prism_rotation") {
+        m_prism_rotation = value;
+    } else if (name == "dispersion") {
+        m_dispersion = value;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool Scene::set_light(const std::string &name) {
+    if (name == "slit") {
+        m_light = LIGHT_SLIT;
+    } else if (name == "ring") {
+        m_light = LIGHT_RING;
+    } else if (name == "halo") {
+        m_light = LIGHT_HALO;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool Scene::set_reflections(const std::string &name) {
+    if (name == "stochastic") {
+        m_reflections = REFLECTIONS_STOCHASTIC;
+    } else if (name == "none") {
+        m_reflections = REFLECTIONS_NONE;
+    } else if (name == "weighted") {
+        m_reflections = REFLECTIONS_WEIGHTED;
+    } else if (name == "split") {
+        m_reflections = REFLECTIONS_SPLIT;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool parse_sweep(const std::string &spec, SceneSweep &sweep) {
+    size_t colon = spec.find(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    sweep.m_name = spec.substr(0, colon);
+
+    std::istringstream is(spec.substr(colon + 1));
+    char separator = 0;
+    is >> sweep.m_from >> separator >> sweep.m_to;
+
+    return !is.fail() && separator == ':' && is.peek() == EOF &&
+        Scene().set(sweep.m_name, 0);
+}
+
+Scene scene_for_frame(const Scene &base, const std::vector<SceneSweep> &sweeps,
+        int frame, int frame_count) {
+
+    Scene scene = base;
+    float fraction = frame_count > 1 ? float(frame)/(frame_count - 1) : 0;
+
+    for (SceneSweep const &sweep : sweeps) {
+        scene.set(sweep.m_name, sweep.m_from + (sweep.m_to - sweep.m_from)*fraction);
+    }
+    scene.update();
+
+    return scene;
+}
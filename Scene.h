@@ -0,0 +1,140 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Vec3.h"
+
+/**
+ * Everything about the scene that can change from frame to frame, and the
+ * geometry derived from it. The defaults reproduce the album cover.
+ */
+class Scene {
+public:
+    // Where the light comes from.
+    enum Light {
+        // Point light off to the left, shining through a slit.
+        LIGHT_SLIT,
+        // Lights in a circle around the prism, close by, aimed at it.
+        LIGHT_RING,
+        // Lights in a wide circle around the prism, aimed at a disc
+        // around its center.
+        LIGHT_HALO,
+    };
+
+    // What glass does with light that could refract.
+    enum Reflections {
+        // Reflect some of it, picked at random by Schlick's approximation.
+        REFLECTIONS_STOCHASTIC,
+        // Refract it all. Total internal reflection still happens.
+        REFLECTIONS_NONE,
+        // Refract it all, but keep only the fraction that Schlick's
+        // approximation says would refract. Same brightness as
+        // REFLECTIONS_STOCHASTIC for light that goes through the prism,
+        // without the noise or the bouncing around inside it.
+        REFLECTIONS_WEIGHTED,
+        // Follow both the reflected and the refracted light, each with
+        // its share of the photon's weight.
+        REFLECTIONS_SPLIT,
+    };
+
+    // Size of the output image.
+    int m_width;
+    int m_height;
+
+    // Degrees to rotate the light around the slit, counter-clockwise
+    // looking down at the paper.
+    float m_light_angle;
+
+    // Degrees to rotate the prism around its center, counter-clockwise.
+    float m_prism_rotation;
+
+    // How much to multiply BK7's Cauchy C term by, to widen the rainbow.
+    float m_dispersion;
+
+    Light m_light;
+
+    // Whether some light also comes from above, to show the prism itself.
+    bool m_fill_light;
+
+    Reflections m_reflections;
+
+    // Photons are dropped after this many bounces off the glass, so that
+    // trapped ones can't go on forever.
+    int m_max_bounces;
+
+    // After this many bounces, reflected photons play Russian roulette
+    // on each bounce: they're dropped with a chance that grows as their
+    // weight shrinks, and the survivors are brightened to make up for it.
+    int m_roulette_bounces;
+
+    // Derived from the above by update().
+
+    // 2D vertices of prism, clockwise from lower-left.
+    Vec3 m_p0;
+    Vec3 m_p1;
+    Vec3 m_p2;
+
+    // 2D normals of prism, clockwise from left face.
+    Vec3 m_n01;
+    Vec3 m_n12;
+    Vec3 m_n20;
+
+    // Added to everything to center the prism at 0,0,0.
+    Vec3 m_offset;
+
+    // Average of the prism vertices.
+    Vec3 m_center;
+
+    // Point light, off to the left.
+    Vec3 m_light_origin;
+
+    // Cauchy's equation coefficients, for micrometers.
+    float m_cauchy_b;
+    float m_cauchy_c;
+
+    Scene();
+
+    // Recompute the derived fields. Call after changing parameters.
+    void update();
+
+    int64_t pixel_count() const { return int64_t(m_width)*m_height; }
+
+    // Index of refraction of the prism for this wavelength in nanometers.
+    float refraction_index(int wavelength) const {
+        // https://en.wikipedia.org/wiki/Cauchy%27s_equation
+        float wl_um = wavelength/1000.0;
+        return m_cauchy_b + m_cauchy_c/(wl_um*wl_um);
+    }
+
+    // Set a parameter by name (light_angle, prism_rotation, dispersion).
+    // Returns whether the name was known. Call update() afterward.
+    bool set(const std::string &name, float value);
+
+    // Set the light by name (slit, ring, halo). Returns whether the name
+    // was known.
+    bool set_light(const std::string &name);
+
+    // Set the reflection mode by name (stochastic, none, weighted,
+    // split). Returns whether the name was known.
+    bool set_reflections(const std::string &name);
+};
+
+/**
+ * A parameter to linearly sweep across the frames of a sequence.
+ */
+struct SceneSweep {
+    std::string m_name;
+    float m_from;
+    float m_to;
+};
+
+// Parse "name:from:to" into a sweep. Returns whether successful.
+bool parse_sweep(const std::string &spec, SceneSweep &sweep);
+
+// Scene for frame "frame" of "frame_count", starting from "base".
+Scene scene_for_frame(const Scene &base, const std::vector<SceneSweep> &sweeps,
+        int frame, int frame_count);
+
+#endif // SCENE_H
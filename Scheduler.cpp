@@ -0,0 +1,231 @@
+
+#include <algorithm>
+#include <iostream>
+#include "Scheduler.h"
+#include "Topology.h"
+
+// Which worker we are, or -1 for threads that aren't workers.
+static thread_local int t_worker_index = -1;
+
+Scheduler::Scheduler(int worker_count, const std::vector<int> &cpus)
+    : m_queued(0),
+      m_unfinished(0),
+      m_progress(0),
+      m_cancelled(false),
+      m_stopping(false),
+      m_next_victim(0) {
+
+    for (int i = 0; i < worker_count; i++) {
+        Worker *worker = new Worker();
+        worker->m_cpu = i < int(cpus.size()) ? cpus[i] : -1;
+        worker->m_pinned_queued = 0;
+        m_workers.push_back(worker);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        m_workers[i]->m_thread = std::thread(&Scheduler::run_worker, this, i);
+    }
+}
+
+Scheduler::~Scheduler() {
+    cancel();
+
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    // Others may still be trying to steal from us until they've all stopped.
+    for (Worker *worker : m_workers) {
+        worker->m_thread.join();
+    }
+    for (Worker *worker : m_workers) {
+        delete worker;
+    }
+}
+
+int Scheduler::worker_index() {
+    return t_worker_index;
+}
+
+void Scheduler::push(int index, Entry &&entry, bool pinned) {
+    Worker *worker = m_workers[index];
+    {
+        std::lock_guard<std::mutex> lock(worker->m_mutex);
+        (pinned ? worker->m_pinned_tasks : worker->m_tasks).push_back(std::move(entry));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+        (pinned ? worker->m_pinned_queued : m_queued)++;
+    }
+
+    // Can't pick which sleeper wakes up, so wake them all for pinned tasks.
+    if (pinned) {
+        m_wake.notify_all();
+    } else {
+        m_wake.notify_one();
+    }
+}
+
+void Scheduler::submit(Task task, TaskGroup *group) {
+    if (m_cancelled) {
+        return;
+    }
+
+    if (group != nullptr) {
+        group->m_pending++;
+    }
+    m_unfinished++;
+
+    // Outsiders spread their tasks around.
+    int index = t_worker_index >= 0 ? t_worker_index : int(m_next_victim++ % m_workers.size());
+    push(index, Entry{std::move(task), group}, false);
+}
+
+void Scheduler::submit_to(int worker, Task task, TaskGroup *group) {
+    if (m_cancelled) {
+        return;
+    }
+
+    if (group != nullptr) {
+        group->m_pending++;
+    }
+    m_unfinished++;
+
+    push(worker, Entry{std::move(task), group}, true);
+}
+
+bool Scheduler::pop(int index, Entry &entry) {
+    Worker *worker = m_workers[index];
+    bool pinned;
+    {
+        std::lock_guard<std::mutex> lock(worker->m_mutex);
+        pinned = !worker->m_pinned_tasks.empty();
+        std::deque<Entry> &tasks = pinned ? worker->m_pinned_tasks : worker->m_tasks;
+        if (tasks.empty()) {
+            return false;
+        }
+        entry = std::move(tasks.front());
+        tasks.pop_front();
+    }
+
+    std::lock_guard<std::mutex> lock(m_sleep_mutex);
+    (pinned ? worker->m_pinned_queued : m_queued)--;
+
+    return true;
+}
+
+bool Scheduler::steal(int index, Entry &entry) {
+    int count = int(m_workers.size());
+
+    for (int i = 1; i < count; i++) {
+        Worker *victim = m_workers[(index + i) % count];
+        {
+            std::lock_guard<std::mutex> lock(victim->m_mutex);
+            if (victim->m_tasks.empty()) {
+                continue;
+            }
+            entry = std::move(victim->m_tasks.back());
+            victim->m_tasks.pop_back();
+        }
+
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+        m_queued--;
+
+        return true;
+    }
+
+    return false;
+}
+
+void Scheduler::run(Entry &entry) {
+    if (!m_cancelled) {
+        entry.m_task();
+    }
+
+    // Release whatever the task captured before anyone sees it finish.
+    entry.m_task = nullptr;
+
+    bool group_done = entry.m_group != nullptr && --entry.m_group->m_pending == 0;
+    bool all_done = --m_unfinished == 0;
+    if (group_done || all_done) {
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+        m_finished.notify_all();
+    }
+}
+
+void Scheduler::run_worker(int index) {
+    t_worker_index = index;
+
+    int cpu = m_workers[index]->m_cpu;
+    if (cpu >= 0 && !pin_current_thread(cpu)) {
+        std::cerr << "Can't pin worker " << index << " to CPU " << cpu << ".\n";
+    }
+
+    while (true) {
+        Entry entry;
+
+        if (pop(index, entry) || steal(index, entry)) {
+            run(entry);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleep_mutex);
+        Worker *worker = m_workers[index];
+        m_wake.wait(lock, [this, worker] {
+            return m_stopping || m_queued > 0 || worker->m_pinned_queued > 0;
+        });
+        if (m_stopping) {
+            break;
+        }
+    }
+}
+
+void Scheduler::wait(TaskGroup &group) {
+    if (t_worker_index >= 0) {
+        // Don't block a worker, help out instead.
+        while (!group.done()) {
+            Entry entry;
+
+            if (pop(t_worker_index, entry) || steal(t_worker_index, entry)) {
+                run(entry);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    } else {
+        std::unique_lock<std::mutex> lock(m_sleep_mutex);
+        m_finished.wait(lock, [&group] { return group.done(); });
+    }
+}
+
+void Scheduler::wait_idle() {
+    std::unique_lock<std::mutex> lock(m_sleep_mutex);
+    m_finished.wait(lock, [this] { return m_unfinished == 0; });
+}
+
+void Scheduler::parallel_for(int64_t begin, int64_t end, int64_t grain,
+        const std::function<void(int64_t, int64_t)> &fn) {
+
+    TaskGroup group;
+
+    for (int64_t chunk = begin; chunk < end; chunk += grain) {
+        int64_t chunk_end = std::min(chunk + grain, end);
+        submit([&fn, chunk, chunk_end] { fn(chunk, chunk_end); }, &group);
+    }
+
+    wait(group);
+}
+
+void Scheduler::cancel() {
+    m_cancelled = true;
+
+    // Drop everything that hasn't started.
+    for (int i = 0; i < worker_count(); i++) {
+        Entry entry;
+        while (pop(i, entry)) {
+            run(entry);
+        }
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Counts outstanding tasks so that a caller can wait for a set of them.
+ */
+class TaskGroup {
+public:
+    TaskGroup() : m_pending(0) {
+        // Nothing.
+    }
+
+    bool done() const { return m_pending == 0; }
+
+private:
+    std::atomic<int> m_pending;
+
+    friend class Scheduler;
+};
+
+/**
+ * Pool of worker threads, one per core, that runs all of our work: photon
+ * batches, tone mapping, and image encoding. Each worker has its own deque
+ * of tasks. It pushes at the back of its own and pops from the front, so
+ * that photon batches that requeue themselves can't starve other work.
+ * When its deque is empty it steals from the back of the others'.
+ *
+ * Workers can optionally be pinned to CPUs, and a task can be pinned to a
+ * worker, for work that should stay near the memory it touches.
+ */
+class Scheduler {
+public:
+    typedef std::function<void()> Task;
+
+    // Start "worker_count" workers. If "cpus" isn't empty, pin worker i
+    // to CPU cpus[i].
+    explicit Scheduler(int worker_count, const std::vector<int> &cpus = std::vector<int>());
+
+    // Cancels anything still queued and joins the workers.
+    ~Scheduler();
+
+    int worker_count() const { return int(m_workers.size()); }
+
+    // Index of the calling worker, or -1 if not called from a worker.
+    static int worker_index();
+
+    // Queue a task, optionally as part of a group. From a worker it goes
+    // on that worker's own deque.
+    void submit(Task task, TaskGroup *group = nullptr);
+
+    // Queue a task that only "worker" may run.
+    void submit_to(int worker, Task task, TaskGroup *group = nullptr);
+
+    // Wait for all tasks in the group to finish. Workers run other tasks
+    // while they wait.
+    void wait(TaskGroup &group);
+
+    // Wait until nothing is queued or running.
+    void wait_idle();
+
+    // Run fn(begin, end) over [begin, end) in chunks of "grain" across the
+    // workers, and wait for it.
+    void parallel_for(int64_t begin, int64_t end, int64_t grain,
+            const std::function<void(int64_t, int64_t)> &fn);
+
+    // Drop all queued tasks and refuse new ones. Long-running tasks should
+    // check cancelled() and stop early.
+    void cancel();
+    bool cancelled() const { return m_cancelled; }
+
+    // Tasks queued or running.
+    int64_t unfinished() const { return m_unfinished; }
+
+    // Generic progress counter (we count photons).
+    void add_progress(int64_t amount) { m_progress += amount; }
+    int64_t progress() const { return m_progress; }
+
+private:
+    struct Entry {
+        Task m_task;
+        TaskGroup *m_group;
+    };
+
+    struct Worker {
+        std::mutex m_mutex;
+        std::deque<Entry> m_tasks;
+        // Tasks that can't be stolen.
+        std::deque<Entry> m_pinned_tasks;
+        std::thread m_thread;
+        int m_cpu;
+        // Size of m_pinned_tasks, protected by m_sleep_mutex.
+        int64_t m_pinned_queued;
+    };
+
+    std::vector<Worker *> m_workers;
+
+    // Protects sleeping and waking; m_queued (stealable tasks) only
+    // changes with it held.
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_finished;
+    int64_t m_queued;
+
+    std::atomic<int64_t> m_unfinished;
+    std::atomic<int64_t> m_progress;
+    std::atomic<bool> m_cancelled;
+    std::atomic<bool> m_stopping;
+    std::atomic<unsigned> m_next_victim;
+
+    void run_worker(int index);
+    bool pop(int index, Entry &entry);
+    bool steal(int index, Entry &entry);
+    void run(Entry &entry);
+    void push(int index, Entry &&entry, bool pinned);
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,117 @@
+
+#include <iostream>
+#include <new>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "SharedFrame.h"
+
+// Keep slots on their own pages.
+static const size_t PAGE_ALIGN = 4096;
+
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1)/align*align;
+}
+
+SharedFrame::SharedFrame()
+    : m_header(nullptr), m_size(0) {
+
+    // Nothing.
+}
+
+SharedFrame::~SharedFrame() {
+    close();
+}
+
+bool SharedFrame::open(const std::string &name, int width, int height) {
+    close();
+
+    size_t pixel_count = size_t(width)*height;
+    size_t accumulator_offset = round_up(pixel_count*sizeof(uint32_t), PAGE_ALIGN);
+    size_t slot_size = round_up(accumulator_offset + pixel_count*3*sizeof(float), PAGE_ALIGN);
+    size_t header_size = round_up(sizeof(SharedFrameHeader), PAGE_ALIGN);
+    size_t size = header_size + 2*slot_size;
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd == -1) {
+        perror(name.c_str());
+        return false;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        perror(name.c_str());
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        perror(name.c_str());
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    m_name = name;
+    m_size = size;
+    m_header = new (p) SharedFrameHeader();
+
+    // Fill the header with the sequence odd so that readers ignore us
+    // until the first frame is published.
+    m_header->m_sequence.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(m_header->m_magic, SHARED_FRAME_MAGIC, sizeof(m_header->m_magic));
+    m_header->m_version = SHARED_FRAME_VERSION;
+    m_header->m_header_size = sizeof(SharedFrameHeader);
+    m_header->m_width = width;
+    m_header->m_height = height;
+    m_header->m_slot_offset[0] = header_size;
+    m_header->m_slot_offset[1] = header_size + slot_size;
+    m_header->m_slot_size = slot_size;
+    m_header->m_accumulator_offset = accumulator_offset;
+    m_header->m_current = 0;
+    m_header->m_frame = 0;
+    m_header->m_elapsed = 0;
+
+    return true;
+}
+
+void SharedFrame::close() {
+    if (m_header != nullptr) {
+        munmap(m_header, m_size);
+        shm_unlink(m_name.c_str());
+        m_header = nullptr;
+        m_size = 0;
+    }
+}
+
+uint8_t *SharedFrame::back_slot() {
+    int back = 1 - m_header->m_current;
+
+    return reinterpret_cast<uint8_t *>(m_header) + m_header->m_slot_offset[back];
+}
+
+uint32_t *SharedFrame::back_pixels() {
+    return reinterpret_cast<uint32_t *>(back_slot());
+}
+
+float *SharedFrame::back_accumulator() {
+    return reinterpret_cast<float *>(back_slot() + m_header->m_accumulator_offset);
+}
+
+void SharedFrame::publish(double elapsed) {
+    uint64_t sequence = m_header->m_sequence.load(std::memory_order_relaxed);
+
+    // Make odd. The fence keeps the header writes below from moving above it.
+    m_header->m_sequence.store(sequence | 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    m_header->m_current = 1 - m_header->m_current;
+    m_header->m_frame++;
+    m_header->m_elapsed = elapsed;
+
+    // Back to even, publishing the slot contents and the header.
+    m_header->m_sequence.store((sequence | 1) + 1, std::memory_order_release);
+}
@@ -0,0 +1,82 @@
+#ifndef SHARED_FRAME_H
+#define SHARED_FRAME_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Identifies the segment, and its layout version.
+static const char SHARED_FRAME_MAGIC[8] = "PRISMFB";
+static const uint32_t SHARED_FRAME_VERSION = 1;
+
+/**
+ * Header at the start of the shared memory segment. Everything is
+ * native-endian. It's followed by two slots, each holding the tone-mapped
+ * image (width*height 32-bit 0x00RRGGBB pixels, the same as minifb) and then
+ * the raw accumulator (width*height*3 floats, linear RGB, row-major).
+ *
+ * The writer fills the slot that readers are not looking at, then bumps
+ * m_sequence to odd, points m_current at it, updates the frame info, and
+ * bumps m_sequence back to even. Readers load m_sequence (retry if odd),
+ * copy what they need out of slot m_current, and accept the copy only if
+ * m_sequence hasn't changed in the meantime.
+ */
+struct SharedFrameHeader {
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_header_size;
+    uint32_t m_width;
+    uint32_t m_height;
+    // Byte offset from the start of the segment to each slot, and slot size.
+    uint64_t m_slot_offset[2];
+    uint64_t m_slot_size;
+    // Byte offset within a slot of the raw accumulator.
+    uint64_t m_accumulator_offset;
+
+    // Seqlock protecting everything below.
+    std::atomic<uint64_t> m_sequence;
+    // Slot (0 or 1) holding the latest frame.
+    uint32_t m_current;
+    uint32_t m_padding;
+    // Number of frames published so far.
+    uint64_t m_frame;
+    // Seconds since the render started.
+    double m_elapsed;
+};
+
+/**
+ * POSIX shared memory segment that the coordinator publishes the image in
+ * progress into. The coordinator writes straight into the back slot, so
+ * publishing copies nothing.
+ */
+class SharedFrame {
+public:
+    SharedFrame();
+    ~SharedFrame();
+
+    // Create (or replace) the named segment, e.g. "/prism". Returns whether
+    // successful.
+    bool open(const std::string &name, int width, int height);
+
+    // Unmap and unlink the segment.
+    void close();
+
+    bool is_open() const { return m_header != nullptr; }
+
+    // Buffers of the slot that readers are not using. Fill these, then
+    // call publish().
+    uint32_t *back_pixels();
+    float *back_accumulator();
+
+    // Make the back slot the current one.
+    void publish(double elapsed);
+
+private:
+    std::string m_name;
+    SharedFrameHeader *m_header;
+    size_t m_size;
+
+    uint8_t *back_slot();
+};
+
+#endif // SHARED_FRAME_H
@@ -0,0 +1,140 @@
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "Accumulator.h"
+#include "SplatBenchmark.h"
+#include "SplatBuffer.h"
+#include "Tracer.h"
+
+/**
+ * A photon landing on the paper.
+ */
+struct Hit {
+    int m_x;
+    int m_y;
+    Vec3 m_rgb;
+};
+
+static const char *LAYOUT_NAMES[] = { "linear", "tiled" };
+
+// Seconds since "start".
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Draw "count" hits in random order, distributed like the light in "image".
+static std::vector<Hit> sample_hits(const Accumulator &image, int64_t count) {
+    int width = image.width();
+    int height = image.height();
+
+    // Linear copy of the image, and the running total of its brightness.
+    std::vector<float> pixels(size_t(width)*height*3, 0.0f);
+    Accumulator::add_rows_to(std::vector<const Accumulator *>(1, &image), pixels.data(), 0, height);
+
+    std::vector<double> cdf(size_t(width)*height);
+    double total = 0;
+    for (size_t i = 0; i < cdf.size(); i++) {
+        total += pixels[i*3 + 0] + pixels[i*3 + 1] + pixels[i*3 + 2];
+        cdf[i] = total;
+    }
+
+    std::vector<Hit> hits;
+    if (total == 0) {
+        return hits;
+    }
+
+    hits.reserve(count);
+    for (int64_t i = 0; i < count; i++) {
+        size_t pixel = std::upper_bound(cdf.begin(), cdf.end(), my_rand()*total) - cdf.begin();
+        pixel = std::min(pixel, cdf.size() - 1);
+
+        Hit hit;
+        hit.m_x = int(pixel % width);
+        hit.m_y = int(pixel / width);
+        hit.m_rgb = Vec3(pixels[pixel*3 + 0], pixels[pixel*3 + 1], pixels[pixel*3 + 2])*0.001;
+        hits.push_back(hit);
+    }
+
+    return hits;
+}
+
+void benchmark_splats(const Scene &scene, int64_t photons, uint64_t seed) {
+    Accumulator::Layout layouts[] = { Accumulator::LAYOUT_LINEAR, Accumulator::LAYOUT_TILED };
+    double trace_rate[2];
+    // Hits per second, into an image of the worker's own and into a
+    // shared one, directly and through a buffer.
+    double splat_rate[2][2];
+    double buffered_rate[2][2];
+    std::vector<Hit> hits;
+
+    std::cout << "Tracing " << photons << " photons into a " << scene.m_width << "x" <<
+        scene.m_height << " image.\n";
+
+    for (int i = 0; i < 2; i++) {
+        Accumulator image(scene.m_width, scene.m_height, layouts[i]);
+
+        // Fault in the pages first so that we only time the splats.
+        image.clear();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        TraceStats stats = TraceStats();
+        tracer_for(scene, layouts[i], false)(scene, image, photons, seed, stats);
+        trace_rate[i] = photons/seconds_since(start);
+
+        if (hits.empty()) {
+            hits = sample_hits(image, photons);
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        for (int shared = 0; shared < 2; shared++) {
+            Accumulator image(scene.m_width, scene.m_height, layouts[i]);
+            image.clear();
+            if (shared) {
+                image.share();
+            }
+
+            // Directly, as the tracer adds to a worker's own image. Hits
+            // on a tiled or shared image are each a write to their tile.
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (layouts[i] == Accumulator::LAYOUT_LINEAR && !shared) {
+                for (const Hit &hit : hits) {
+                    image.add(hit.m_x, hit.m_y, hit.m_rgb);
+                }
+            } else {
+                for (const Hit &hit : hits) {
+                    image.add_to_tile(image.pixel_index(hit.m_x, hit.m_y),
+                            hit.m_rgb.r(), hit.m_rgb.g(), hit.m_rgb.b());
+                }
+            }
+            splat_rate[i][shared] = hits.size()/seconds_since(start);
+
+            // Through a splat buffer, as the tracer adds to a shared image.
+            SplatBuffer splats(image);
+            start = std::chrono::steady_clock::now();
+            for (const Hit &hit : hits) {
+                splats.add(hit.m_x, hit.m_y, hit.m_rgb);
+            }
+            splats.flush();
+            buffered_rate[i][shared] = hits.size()/seconds_since(start);
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "                                     Own image (M hits/s)    Shared image (M hits/s)\n";
+    std::cout << "Layout   Trace (M photons/s)        Splat     Buffered         Splat     Buffered\n";
+    for (int i = 0; i < 2; i++) {
+        std::cout << std::left << std::setw(9) << LAYOUT_NAMES[i] << std::right <<
+            std::setw(19) << trace_rate[i]/1e6;
+        for (int shared = 0; shared < 2; shared++) {
+            std::cout << std::setw(shared ? 14 : 13) << splat_rate[i][shared]/1e6 <<
+                std::setw(13) << buffered_rate[i][shared]/1e6;
+        }
+        std::cout << "\n";
+    }
+    std::cout << "Tiled splats are " << splat_rate[1][0]/splat_rate[0][0] << "x as fast.\n";
+}
@@ -0,0 +1,13 @@
+#ifndef SPLAT_BENCHMARK_H
+#define SPLAT_BENCHMARK_H
+
+#include <stdint.h>
+#include "Scene.h"
+
+// Compare the accumulator layouts on one thread: the speed of tracing
+// "photons" photons into each, and of splatting a stream of floor hits
+// with the same distribution but without the tracing, directly and
+// through a SplatBuffer. Prints a table.
+void benchmark_splats(const Scene &scene, int64_t photons, uint64_t seed);
+
+#endif // SPLAT_BENCHMARK_H
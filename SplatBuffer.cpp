@@ -0,0 +1,93 @@
+
+#include <string.h>
+#include <algorithm>
+#include "SplatBuffer.h"
+
+// Bits of the tile number sorted per radix pass.
+static const int RADIX_BITS = 8;
+static const int RADIX_SIZE = 1 << RADIX_BITS;
+
+SplatBuffer::SplatBuffer(Accumulator &image)
+    : m_image(image),
+      m_tile_bits(0),
+      m_count(0) {
+
+    while ((size_t(1) << m_tile_bits) < image.tile_count()) {
+        m_tile_bits++;
+    }
+}
+
+void SplatBuffer::flush() {
+    Splat *splats = m_splats;
+    Splat *sorted = m_sorted;
+
+    // Least-significant digit first, so each pass keeps the order of the
+    // previous one. Two passes for a 3300x4200 image.
+    for (int shift = 0; shift < m_tile_bits; shift += RADIX_BITS) {
+        int count[RADIX_SIZE];
+        memset(count, 0, sizeof(count));
+
+        for (int i = 0; i < m_count; i++) {
+            count[(Accumulator::tile_of(splats[i].m_pixel) >> shift) & (RADIX_SIZE - 1)]++;
+        }
+
+        // Turn counts into starting positions.
+        int position = 0;
+        for (int digit = 0; digit < RADIX_SIZE; digit++) {
+            int digit_count = count[digit];
+            count[digit] = position;
+            position += digit_count;
+        }
+
+        for (int i = 0; i < m_count; i++) {
+            sorted[count[(Accumulator::tile_of(splats[i].m_pixel) >> shift) & (RADIX_SIZE - 1)]++] = splats[i];
+        }
+
+        std::swap(splats, sorted);
+    }
+
+    switch (m_image.format()) {
+        case Accumulator::FORMAT_FLOAT:
+            add_sorted<Accumulator::FORMAT_FLOAT>(splats);
+            break;
+
+        case Accumulator::FORMAT_FIXED32:
+            add_sorted<Accumulator::FORMAT_FIXED32>(splats);
+            break;
+
+        case Accumulator::FORMAT_FIXED64:
+            add_sorted<Accumulator::FORMAT_FIXED64>(splats);
+            break;
+    }
+
+    m_count = 0;
+}
+
+template <Accumulator::Format FORMAT>
+void SplatBuffer::add_sorted(const Splat *splats) {
+    // Add a tile's worth at a time.
+    bool locked = m_image.has_tile_locks();
+    for (int begin = 0; begin < m_count; ) {
+        size_t tile = Accumulator::tile_of(splats[begin].m_pixel);
+
+        int end = begin + 1;
+        while (end < m_count && Accumulator::tile_of(splats[end].m_pixel) == tile) {
+            end++;
+        }
+
+        if (locked) {
+            m_image.lock_tile(tile);
+        }
+        m_image.begin_tile_write(tile);
+        for (int i = begin; i < end; i++) {
+            m_image.add_as<FORMAT>(splats[i].m_pixel, splats[i].m_rgb[0], splats[i].m_rgb[1], splats[i].m_rgb[2]);
+        }
+        m_image.end_tile_write(tile);
+        m_image.mark_dirty(tile);
+        if (locked) {
+            m_image.unlock_tile(tile);
+        }
+
+        begin = end;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef SPLAT_BUFFER_H
+#define SPLAT_BUFFER_H
+
+#include <stdint.h>
+#include "Accumulator.h"
+
+// Number of hits to collect before adding them to the accumulator.
+static const int SPLAT_BUFFER_SIZE = 2048;
+
+/**
+ * Floor hits waiting to be added to an accumulator. Adding each hit as it
+ * lands scatters writes all over the image. Instead we collect a couple of
+ * thousand, radix-sort them by tile, and add them a tile at a time, so the
+ * writes to each tile happen together. If the accumulator is shared and
+ * needs tile locks, each is taken once per run of hits rather than once
+ * per hit. Sorting costs more than it saves while the image fits in the
+ * cache, so the tracer only buffers hits on shared accumulators.
+ *
+ * One per worker. Call flush() when done.
+ */
+class SplatBuffer {
+public:
+    explicit SplatBuffer(Accumulator &image);
+
+    // Add a color to a pixel, eventually.
+    void add(int x, int y, Vec3 const &rgb) {
+        if (m_image.layout() == Accumulator::LAYOUT_LINEAR) {
+            add_as<Accumulator::LAYOUT_LINEAR>(x, y, rgb);
+        } else {
+            add_as<Accumulator::LAYOUT_TILED>(x, y, rgb);
+        }
+    }
+
+    // Same, for code that's specialized for the accumulator's layout.
+    template <Accumulator::Layout LAYOUT>
+    void add_as(int x, int y, Vec3 const &rgb) {
+        Splat &splat = m_splats[m_count];
+        splat.m_pixel = uint32_t(m_image.pixel_index_as<LAYOUT>(x, y));
+        splat.m_rgb[0] = rgb.r();
+        splat.m_rgb[1] = rgb.g();
+        splat.m_rgb[2] = rgb.b();
+
+        if (++m_count == SPLAT_BUFFER_SIZE) {
+            flush();
+        }
+    }
+
+    // Add all collected hits to the accumulator.
+    void flush();
+
+private:
+    struct Splat {
+        uint32_t m_pixel;
+        float m_rgb[3];
+    };
+
+    Accumulator &m_image;
+    // Bits of tile number to sort on.
+    int m_tile_bits;
+    int m_count;
+    Splat m_splats[SPLAT_BUFFER_SIZE];
+    Splat m_sorted[SPLAT_BUFFER_SIZE];
+
+    // Add the sorted splats, specialized for the accumulator's format.
+    template <Accumulator::Format FORMAT>
+    void add_sorted(const Splat *splats);
+
+    // Not copyable.
+    SplatBuffer(const SplatBuffer &);
+    SplatBuffer &operator=(const SplatBuffer &);
+};
+
+#endif // SPLAT_BUFFER_H
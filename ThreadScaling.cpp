@@ -0,0 +1,225 @@
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "FrameQueue.h"
+#include "Scheduler.h"
+#include "ThreadScaling.h"
+#include "Tracer.h"
+
+// Photons that each thread traces per configuration.
+static const int64_t SCALING_PHOTONS_PER_THREAD = 2000000;
+
+// Bytes that all threads stream through together to measure the memory
+// bandwidth, well past any cache, and how many times.
+static const size_t STREAM_BYTES = 256*1024*1024;
+static const int STREAM_PASSES = 4;
+
+/**
+ * Speeds of one configuration.
+ */
+struct ScalingResult {
+    ThreadConfig m_config;
+    double m_photon_rate;
+    // Bytes per second, read and written.
+    double m_bandwidth;
+};
+
+// Seconds since "start".
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Run fn(worker) once on each worker, and wait.
+static void run_on_each(Scheduler &scheduler, const std::function<void(int)> &fn) {
+    TaskGroup group;
+
+    for (int worker = 0; worker < scheduler.worker_count(); worker++) {
+        scheduler.submit_to(worker, [&fn, worker] { fn(worker); }, &group);
+    }
+    scheduler.wait(group);
+}
+
+static ScalingResult measure(const Scene &scene, const Topology &topology, const ThreadConfig &config,
+        Accumulator::Layout layout, Accumulator::Format format, uint64_t seed) {
+
+    ScalingResult result;
+    result.m_config = config;
+
+    int threads = config.m_threads;
+    Scheduler scheduler(threads, topology.worker_cpus(threads, config.m_placement));
+    TraceFunction tracer = tracer_for(scene, layout, false);
+
+    // Each worker faults in its own image, as in a render, so that we
+    // only time the photons.
+    std::vector<Accumulator *> images(threads);
+    run_on_each(scheduler, [&](int worker) {
+        images[worker] = new Accumulator(scene.m_width, scene.m_height, layout, format);
+        images[worker]->clear();
+    });
+
+    int64_t photons = SCALING_PHOTONS_PER_THREAD*threads;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    scheduler.parallel_for(0, photons, PHOTONS_PER_BATCH, [&](int64_t begin, int64_t end) {
+        TraceStats stats = TraceStats();
+        tracer(scene, *images[Scheduler::worker_index()], end - begin,
+                seed*1000003 + begin/PHOTONS_PER_BATCH, stats);
+    });
+    result.m_photon_rate = photons/seconds_since(start);
+
+    for (Accumulator *image : images) {
+        delete image;
+    }
+
+    // Each worker streams through its share of a buffer that it touched
+    // first, so that it's on its own node.
+    size_t count = STREAM_BYTES/sizeof(float)/threads;
+    std::vector<std::vector<float>> buffers(threads);
+    run_on_each(scheduler, [&](int worker) {
+        buffers[worker].assign(count, 1.0f);
+    });
+
+    start = std::chrono::steady_clock::now();
+    run_on_each(scheduler, [&](int worker) {
+        float *values = buffers[worker].data();
+        for (int pass = 0; pass < STREAM_PASSES; pass++) {
+            for (size_t i = 0; i < count; i++) {
+                values[i] = values[i]*0.5f + 1.0f;
+            }
+        }
+    });
+    result.m_bandwidth = 2.0*count*sizeof(float)*threads*STREAM_PASSES/seconds_since(start);
+
+    return result;
+}
+
+ThreadConfig run_scaling_sweep(const Scene &scene, const Topology &topology,
+        Accumulator::Layout layout, Accumulator::Format format, uint64_t seed) {
+
+    int cpu_count = topology.cpu_count();
+    int core_count = topology.core_count();
+
+    // Powers of two, and one thread per core and per CPU.
+    std::vector<int> counts;
+    for (int count = 1; count < cpu_count; count *= 2) {
+        counts.push_back(count);
+    }
+    counts.push_back(core_count);
+    counts.push_back(cpu_count);
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+
+    std::cout << "Tracing " << SCALING_PHOTONS_PER_THREAD << " photons per thread into " <<
+        scene.m_width << "x" << scene.m_height << " images, on " << cpu_count << " CPUs of " <<
+        core_count << " cores.\n";
+    std::cout << "Threads  Placement   M photons/s   Per thread   Memory (GB/s)\n";
+
+    std::vector<ScalingResult> results;
+    for (int count : counts) {
+        for (Topology::Placement placement : { Topology::PLACEMENT_CORES, Topology::PLACEMENT_SIBLINGS }) {
+            // Siblings first only differs with SMT, and two or more
+            // threads on some of the CPUs.
+            if (placement == Topology::PLACEMENT_SIBLINGS &&
+                    (!topology.has_smt() || count < 2 || count == cpu_count)) {
+
+                continue;
+            }
+
+            ScalingResult result = measure(scene, topology, ThreadConfig{count, placement},
+                    layout, format, seed);
+            results.push_back(result);
+
+            std::cout << std::fixed << std::setprecision(2) << std::setw(7) << count << "  " <<
+                std::left << std::setw(9) << placement_name(placement) << std::right <<
+                std::setw(14) << result.m_photon_rate/1e6 <<
+                std::setw(13) << result.m_photon_rate/count/1e6 <<
+                std::setw(16) << result.m_bandwidth/1e9 << "\n";
+        }
+    }
+
+    const ScalingResult *best = &results[0];
+    for (const ScalingResult &result : results) {
+        if (result.m_photon_rate > best->m_photon_rate) {
+            best = &result;
+        }
+    }
+    std::cout << "Fastest is " << best->m_config.m_threads << " threads placed by " <<
+        placement_name(best->m_config.m_placement) << ".\n";
+    std::cout.unsetf(std::ios::fixed);
+
+    return best->m_config;
+}
+
+// Directory of our cached files.
+static std::string cache_directory() {
+    const char *cache = getenv("XDG_CACHE_HOME");
+    if (cache != nullptr && cache[0] != '\0') {
+        return std::string(cache) + "/prism";
+    }
+
+    const char *home = getenv("HOME");
+    return std::string(home != nullptr ? home : ".") + "/.cache/prism";
+}
+
+std::string thread_config_pathname() {
+    // Home directories may be shared by several machines.
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+
+    return cache_directory() + "/threads-" + host;
+}
+
+bool load_thread_config(const Topology &topology, ThreadConfig &config) {
+    std::ifstream f(thread_config_pathname());
+    std::string key;
+    std::string value;
+    int cpus = 0;
+    int threads = 0;
+    bool has_placement = false;
+
+    while (f >> key >> value) {
+        if (key == "cpus") {
+            cpus = atoi(value.c_str());
+        } else if (key == "threads") {
+            threads = atoi(value.c_str());
+        } else if (key == "placement") {
+            has_placement = parse_placement(value, config.m_placement);
+        }
+    }
+
+    // Rerun the sweep if we're allowed a different set of CPUs.
+    if (cpus != topology.cpu_count() || threads < 1 || threads > cpus || !has_placement) {
+        return false;
+    }
+    config.m_threads = threads;
+
+    return true;
+}
+
+bool save_thread_config(const Topology &topology, const ThreadConfig &config) {
+    std::string directory = cache_directory();
+    mkdir(directory.substr(0, directory.rfind('/')).c_str(), 0755);
+    mkdir(directory.c_str(), 0755);
+
+    std::string pathname = thread_config_pathname();
+    std::ofstream f(pathname);
+    f << "cpus " << topology.cpu_count() << "\n";
+    f << "threads " << config.m_threads << "\n";
+    f << "placement " << placement_name(config.m_placement) << "\n";
+    f.close();
+
+    if (!f) {
+        std::cerr << "Cannot write " << pathname << "\n";
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef THREAD_SCALING_H
+#define THREAD_SCALING_H
+
+#include <stdint.h>
+#include <string>
+#include "Accumulator.h"
+#include "Scene.h"
+#include "Topology.h"
+
+/**
+ * How many workers to run, and which CPUs they're pinned to.
+ */
+struct ThreadConfig {
+    int m_threads;
+    Topology::Placement m_placement;
+};
+
+// Trace the scene's photons with a range of thread counts, pinned by each
+// placement that differs on this machine, into per-worker accumulators of
+// this layout and format, as a render would. Prints the photons per second
+// and the memory bandwidth that the same threads get, and returns the
+// fastest configuration.
+ThreadConfig run_scaling_sweep(const Scene &scene, const Topology &topology,
+        Accumulator::Layout layout, Accumulator::Format format, uint64_t seed);
+
+// Pathname of the file that caches this machine's best configuration.
+std::string thread_config_pathname();
+
+// Load the cached configuration. Returns whether there was one for a
+// machine with this many CPUs.
+bool load_thread_config(const Topology &topology, ThreadConfig &config);
+
+// Cache the configuration. Returns whether successful.
+bool save_thread_config(const Topology &topology, const ThreadConfig &config);
+
+#endif // THREAD_SCALING_H
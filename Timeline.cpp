@@ -0,0 +1,135 @@
+
+#include <stdio.h>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include "Scheduler.h"
+#include "Timeline.h"
+
+/**
+ * A span or a counter value on the timeline.
+ */
+struct TimelineEvent {
+    const char *m_name;
+    // Nanoseconds, on timeline_now()'s clock.
+    int64_t m_start;
+    // Nanoseconds, or -1 for a counter.
+    int64_t m_duration;
+    double m_value;
+    std::string m_args;
+};
+
+/**
+ * Events of one thread. Only that thread adds to them.
+ */
+struct TimelineThread {
+    std::string m_name;
+    std::vector<TimelineEvent> m_events;
+};
+
+static std::atomic<bool> g_timeline_on;
+static int64_t g_timeline_start;
+
+// Every thread's events, kept until we exit, since workers come and go.
+static std::mutex g_threads_mutex;
+static std::vector<TimelineThread *> g_threads;
+
+static thread_local TimelineThread *t_thread;
+
+// Events of the calling thread.
+static TimelineThread &this_thread() {
+    if (t_thread == nullptr) {
+        t_thread = new TimelineThread();
+
+        int worker = Scheduler::worker_index();
+        if (worker >= 0) {
+            t_thread->m_name = "worker " + std::to_string(worker);
+        } else {
+            t_thread->m_name = "main";
+        }
+
+        std::lock_guard<std::mutex> lock(g_threads_mutex);
+        g_threads.push_back(t_thread);
+    }
+
+    return *t_thread;
+}
+
+void timeline_start() {
+    g_timeline_start = timeline_now();
+    g_timeline_on = true;
+}
+
+bool timeline_is_on() {
+    return g_timeline_on;
+}
+
+void timeline_add_span(const char *name, int64_t start, int64_t end, const std::string &args) {
+    if (g_timeline_on) {
+        this_thread().m_events.push_back(TimelineEvent{name, start, end - start, 0, args});
+    }
+}
+
+void timeline_add_counter(const char *name, double value) {
+    if (g_timeline_on) {
+        this_thread().m_events.push_back(TimelineEvent{name, timeline_now(), -1, value, ""});
+    }
+}
+
+void TimerProfiler::finish(int64_t photons) {
+    enter(m_phase);
+
+    std::ostringstream args;
+    args << "\"photons\": " << photons;
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        args << ", \"" << PerfCounters::phase_name(phase) << " ms\": " << m_phase_time[phase]*1e-6;
+    }
+    timeline_add_span("trace batch", m_start, m_last, args.str());
+}
+
+bool timeline_save(const std::string &pathname) {
+    std::lock_guard<std::mutex> lock(g_threads_mutex);
+    std::ofstream f(pathname);
+
+    // Times are in microseconds.
+    f << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    f << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"prism\"}}";
+    for (size_t tid = 0; tid < g_threads.size(); tid++) {
+        const TimelineThread &thread = *g_threads[tid];
+
+        f << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid <<
+            ", \"args\": {\"name\": \"" << thread.m_name << "\"}}";
+
+        for (const TimelineEvent &event : thread.m_events) {
+            char times[64];
+            snprintf(times, sizeof(times), "%.3f", (event.m_start - g_timeline_start)*1e-3);
+
+            f << ",\n{\"name\": \"" << event.m_name << "\", \"pid\": 1, \"tid\": " << tid <<
+                ", \"ts\": " << times;
+            if (event.m_duration >= 0) {
+                snprintf(times, sizeof(times), "%.3f", event.m_duration*1e-3);
+                f << ", \"ph\": \"X\", \"dur\": " << times;
+                if (!event.m_args.empty()) {
+                    f << ", \"args\": {" << event.m_args << "}";
+                }
+            } else {
+                snprintf(times, sizeof(times), "%.15g", event.m_value);
+                f << ", \"ph\": \"C\", \"args\": {\"value\": " << times << "}";
+            }
+            f << "}";
+        }
+    }
+    f << "\n]}\n";
+    f.close();
+
+    if (!f) {
+        std::cerr << "Cannot write " << pathname << "\n";
+        return false;
+    }
+    std::cout << "Saved timeline to " << pathname << "\n";
+
+    return true;
+}
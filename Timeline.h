@@ -0,0 +1,107 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include "PerfCounters.h"
+
+// Timeline of what each thread did, saved as a Chrome trace (JSON) that
+// chrome://tracing and Perfetto can show. Only built with the
+// PRISM_TIMELINE CMake option, and only recorded after timeline_start().
+// Without the option, TIMED_SCOPE() and TIMELINE_COUNTER() compile to
+// nothing.
+
+// Start recording.
+void timeline_start();
+
+// Whether we're recording.
+bool timeline_is_on();
+
+// Nanoseconds since an arbitrary point, on the timeline's clock.
+inline int64_t timeline_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Record that the calling thread spent [start, end) on "name", which must
+// be a string literal. "args" is empty or a JSON object's members.
+void timeline_add_span(const char *name, int64_t start, int64_t end, const std::string &args = "");
+
+// Record the value of a counter, drawn as a graph.
+void timeline_add_counter(const char *name, double value);
+
+// Write everything recorded so far to "pathname". Returns whether successful.
+bool timeline_save(const std::string &pathname);
+
+/**
+ * Records the time from its construction to its destruction as a span.
+ */
+class ScopedTimer {
+public:
+    explicit ScopedTimer(const char *name)
+        : m_name(name),
+          m_start(timeline_is_on() ? timeline_now() : -1) {
+
+        // Nothing.
+    }
+
+    ~ScopedTimer() {
+        if (m_start >= 0) {
+            timeline_add_span(m_name, m_start, timeline_now());
+        }
+    }
+
+private:
+    const char *m_name;
+    int64_t m_start;
+
+    // Not copyable.
+    ScopedTimer(const ScopedTimer &);
+    ScopedTimer &operator=(const ScopedTimer &);
+};
+
+#ifdef TIMELINE
+#define TIMELINE_CONCAT2(a, b) a##b
+#define TIMELINE_CONCAT(a, b) TIMELINE_CONCAT2(a, b)
+#define TIMED_SCOPE(name) ScopedTimer TIMELINE_CONCAT(scoped_timer_, __LINE__)(name)
+#define TIMELINE_COUNTER(name, value) timeline_add_counter(name, value)
+#else
+#define TIMED_SCOPE(name) do {} while (0)
+#define TIMELINE_COUNTER(name, value) do {} while (0)
+#endif
+
+/**
+ * Tracing loop profiler (see PerfCounters.h) that times each phase, and
+ * adds the batch to the timeline with the time of each phase. Phases
+ * switch every bounce, too often for a span each.
+ */
+class TimerProfiler {
+public:
+    TimerProfiler()
+        : m_phase(PHASE_RNG),
+          m_start(timeline_now()),
+          m_last(m_start) {
+
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            m_phase_time[phase] = 0;
+        }
+    }
+
+    void enter(TracePhase phase) {
+        int64_t now = timeline_now();
+        m_phase_time[m_phase] += now - m_last;
+        m_last = now;
+        m_phase = phase;
+    }
+
+    void finish(int64_t photons);
+
+private:
+    TracePhase m_phase;
+    int64_t m_start;
+    int64_t m_last;
+    int64_t m_phase_time[PHASE_COUNT];
+};
+
+#endif // TIMELINE_H
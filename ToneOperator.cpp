@@ -0,0 +1,173 @@
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "Timeline.h"
+#include "ToneOperator.h"
+
+// Pixels per task.
+static const int64_t TONE_GRAIN = 64*1024;
+
+// Average luminance that the Reinhard and filmic operators map to.
+static const float MIDDLE_GRAY = 0.18f;
+
+static const char *OPERATOR_NAMES[] = { "log", "reinhard", "filmic" };
+
+const char *tone_operator_name(ToneOperator op) {
+    return OPERATOR_NAMES[op];
+}
+
+bool parse_tone_operator(const std::string &name, ToneOperator &op) {
+    for (size_t i = 0; i < sizeof(OPERATOR_NAMES)/sizeof(OPERATOR_NAMES[0]); i++) {
+        if (name == OPERATOR_NAMES[i]) {
+            op = ToneOperator(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Hable's curve, from Uncharted 2, before dividing by the white point's.
+static inline float hable(float x) {
+    const float a = 0.15f;
+    const float b = 0.50f;
+    const float c = 0.10f;
+    const float d = 0.20f;
+    const float e = 0.02f;
+    const float f = 0.30f;
+
+    return (x*(a*x + c*b) + d*e)/(x*(a*x + b) + d*f) - e/f;
+}
+
+// Map one value, already scaled, to 0 to 1 before gamma. The white point's
+// constants are passed in so that loops compute them once.
+template <ToneOperator OP>
+static inline float map_value(float x, float log_white, float white_squared, float hable_white) {
+
+    float v;
+
+    if (OP == TONE_LOG) {
+        v = log(1 + x)/log_white;
+    } else if (OP == TONE_REINHARD) {
+        v = x*(1 + x/white_squared)/(1 + x);
+    } else {
+        v = hable(x)/hable_white;
+    }
+
+    return std::min(std::max(v, 0.0f), 1.0f);
+}
+
+// Map values [begin, end) with the operator, scaling them by "scale"
+// first. Compiled for each operator so that the loop has no branches.
+template <ToneOperator OP>
+static void map_values(const float *linear, float *image_norm, int64_t begin, int64_t end,
+        float scale, float white) {
+
+    float log_white = log(1 + white);
+    float white_squared = white*white;
+    float hable_white = hable(white);
+
+    for (int64_t i = begin; i < end; i++) {
+        float v = map_value<OP>(linear[i]*scale, log_white, white_squared, hable_white);
+        image_norm[i] = 255*pow(v, GAMMA);
+    }
+}
+
+float ToneCurve::map(float linear) const {
+    float x = linear*m_scale;
+    float log_white = log(1 + m_white);
+    float white_squared = m_white*m_white;
+    float hable_white = hable(m_white);
+    float v;
+
+    switch (m_operator) {
+        case TONE_LOG:
+        default:
+            v = map_value<TONE_LOG>(x, log_white, white_squared, hable_white);
+            break;
+
+        case TONE_REINHARD:
+            v = map_value<TONE_REINHARD>(x, log_white, white_squared, hable_white);
+            break;
+
+        case TONE_FILMIC:
+            v = map_value<TONE_FILMIC>(x, log_white, white_squared, hable_white);
+            break;
+    }
+
+    return 255*pow(v, GAMMA);
+}
+
+ToneCurve apply_tone_operator(Scheduler &scheduler, const ToneSettings &settings, const float *linear,
+        int64_t pixel_count, float *image_norm) {
+
+    TIMED_SCOPE("tone operator");
+
+    // Max value, and the sum of the log luminance of lit pixels, by task.
+    int64_t chunk_count = (pixel_count + TONE_GRAIN - 1)/TONE_GRAIN;
+    std::vector<float> chunk_max(chunk_count);
+    std::vector<double> chunk_log_sum(chunk_count);
+    std::vector<int64_t> chunk_lit(chunk_count);
+
+    scheduler.parallel_for(0, pixel_count, TONE_GRAIN, [&](int64_t begin, int64_t end) {
+        float max = 0;
+        double log_sum = 0;
+        int64_t lit = 0;
+
+        for (int64_t i = begin; i < end; i++) {
+            const float *rgb = linear + i*3;
+            max = std::max(max, std::max(rgb[0], std::max(rgb[1], rgb[2])));
+
+            float luminance = 0.2126f*rgb[0] + 0.7152f*rgb[1] + 0.0722f*rgb[2];
+            if (luminance > 0) {
+                log_sum += log(luminance);
+                lit++;
+            }
+        }
+
+        chunk_max[begin/TONE_GRAIN] = max;
+        chunk_log_sum[begin/TONE_GRAIN] = log_sum;
+        chunk_lit[begin/TONE_GRAIN] = lit;
+    });
+
+    float max = 0;
+    double log_sum = 0;
+    int64_t lit = 0;
+    for (int64_t i = 0; i < chunk_count; i++) {
+        max = std::max(max, chunk_max[i]);
+        log_sum += chunk_log_sum[i];
+        lit += chunk_lit[i];
+    }
+
+    float scale = exp2(settings.m_exposure);
+    if (settings.m_operator != TONE_LOG && lit > 0) {
+        scale *= MIDDLE_GRAY/exp(log_sum/lit);
+    }
+
+    // Keep black images black.
+    float white = settings.m_white > 0 ? settings.m_white : max*scale;
+    if (white <= 0) {
+        white = 1;
+    }
+
+    scheduler.parallel_for(0, pixel_count*3, TONE_GRAIN*3, [&](int64_t begin, int64_t end) {
+        TIMED_SCOPE("map");
+
+        switch (settings.m_operator) {
+            case TONE_LOG:
+                map_values<TONE_LOG>(linear, image_norm, begin, end, scale, white);
+                break;
+
+            case TONE_REINHARD:
+                map_values<TONE_REINHARD>(linear, image_norm, begin, end, scale, white);
+                break;
+
+            case TONE_FILMIC:
+                map_values<TONE_FILMIC>(linear, image_norm, begin, end, scale, white);
+                break;
+        }
+    });
+
+    return ToneCurve(settings.m_operator, scale, white);
+}
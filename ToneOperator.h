@@ -0,0 +1,86 @@
+#ifndef TONE_OPERATOR_H
+#define TONE_OPERATOR_H
+
+#include <stdint.h>
+#include <string>
+#include "Scheduler.h"
+
+// Display gamma.
+static const float GAMMA = 1/2.2;
+
+// Curves from linear light to display brightness.
+enum ToneOperator {
+    // Log of one plus the value, what renders use.
+    TONE_LOG,
+    // Reinhard's x/(1 + x), extended so that the white point maps to 1.
+    TONE_REINHARD,
+    // John Hable's filmic curve, with a toe and a soft shoulder.
+    TONE_FILMIC,
+};
+
+const char *tone_operator_name(ToneOperator op);
+
+// Parse an operator name. Returns whether successful.
+bool parse_tone_operator(const std::string &name, ToneOperator &op);
+
+/**
+ * How to map linear sums to display values.
+ */
+struct ToneSettings {
+    ToneOperator m_operator;
+    // Stops brighter than the operator's default. The log operator takes
+    // the sums as they are; the others first scale them so that the
+    // average (log) luminance of pixels with any light is middle gray.
+    float m_exposure;
+    // Value, after exposure, that maps to full brightness, or 0 for the
+    // brightest value in the image.
+    float m_white;
+
+    ToneSettings()
+        : m_operator(TONE_LOG),
+          m_exposure(0),
+          m_white(0) {
+
+        // Nothing.
+    }
+};
+
+/**
+ * The curve an image was mapped with, so that other values, such as
+ * averages of its linear pixels, can be mapped the same way.
+ */
+struct ToneCurve {
+    ToneOperator m_operator;
+    // Multiplies the values first.
+    float m_scale;
+    // Value, after scaling, that maps to full brightness.
+    float m_white;
+
+    ToneCurve()
+        : m_operator(TONE_LOG),
+          m_scale(1),
+          m_white(1) {
+
+        // Nothing.
+    }
+
+    ToneCurve(ToneOperator op, float scale, float white)
+        : m_operator(op),
+          m_scale(scale),
+          m_white(white) {
+
+        // Nothing.
+    }
+
+    // Map one linear value to 0 to 255, gamma-corrected.
+    float map(float linear) const;
+};
+
+// Map "linear" (row-major RGB, "pixel_count" pixels) to "image_norm"
+// (0 to 255, gamma-corrected) on the scheduler's workers. Each pass is a
+// flat loop over the values, which the compiler vectorizes. Returns the
+// curve used.
+ToneCurve apply_tone_operator(Scheduler &scheduler, const ToneSettings &settings, const float *linear,
+        int64_t pixel_count, float *image_norm);
+
+#endif // TONE_OPERATOR_H
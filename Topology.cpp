@@ -0,0 +1,229 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include "Topology.h"
+
+// Read the first line of a file, or return an empty string.
+static std::string read_line(const std::string &pathname) {
+    std::ifstream f(pathname);
+    std::string line;
+    std::getline(f, line);
+
+    return line;
+}
+
+std::vector<int> parse_cpu_list(const std::string &list) {
+    std::vector<int> cpus;
+    std::istringstream is(list);
+    std::string range;
+
+    while (std::getline(is, range, ',')) {
+        int first, last;
+
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2) {
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        } else if (sscanf(range.c_str(), "%d", &first) == 1) {
+            cpus.push_back(first);
+        }
+    }
+
+    return cpus;
+}
+
+// CPUs we're allowed to run on.
+static std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+
+    if (cpus.empty()) {
+        int count = std::max(1u, std::thread::hardware_concurrency());
+        for (int cpu = 0; cpu < count; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
+}
+
+Topology Topology::detect() {
+    Topology topology;
+    std::vector<int> allowed = allowed_cpus();
+
+    // Nodes are numbered but may have gaps.
+    std::vector<int> nodes = parse_cpu_list(read_line("/sys/devices/system/node/online"));
+    for (int node : nodes) {
+        std::ostringstream pathname;
+        pathname << "/sys/devices/system/node/node" << node << "/cpulist";
+
+        std::vector<int> node_cpus;
+        for (int cpu : parse_cpu_list(read_line(pathname.str()))) {
+            if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                node_cpus.push_back(cpu);
+            }
+        }
+
+        // Skip memory-only nodes and nodes we can't run on.
+        if (!node_cpus.empty()) {
+            topology.m_node_cpus.push_back(node_cpus);
+        }
+    }
+
+    if (topology.m_node_cpus.empty()) {
+        topology.m_node_cpus.push_back(allowed);
+    }
+
+    // SMT siblings share a core. Without sysfs, each CPU is its own.
+    for (int cpu : allowed) {
+        std::ostringstream pathname;
+        pathname << "/sys/devices/system/cpu/cpu" << cpu << "/topology/thread_siblings_list";
+        std::vector<int> siblings = parse_cpu_list(read_line(pathname.str()));
+
+        if (int(topology.m_cpu_cores.size()) <= cpu) {
+            topology.m_cpu_cores.resize(cpu + 1, -1);
+        }
+        topology.m_cpu_cores[cpu] = siblings.empty() ? cpu : siblings[0];
+    }
+
+    return topology;
+}
+
+int Topology::cpu_count() const {
+    int count = 0;
+
+    for (std::vector<int> const &cpus : m_node_cpus) {
+        count += int(cpus.size());
+    }
+
+    return count;
+}
+
+int Topology::core_count() const {
+    std::vector<int> cores;
+
+    for (std::vector<int> const &cpus : m_node_cpus) {
+        for (int cpu : cpus) {
+            cores.push_back(core_of(cpu));
+        }
+    }
+    std::sort(cores.begin(), cores.end());
+
+    return int(std::unique(cores.begin(), cores.end()) - cores.begin());
+}
+
+std::vector<int> Topology::worker_nodes(int worker_count) const {
+    std::vector<int> nodes;
+    int total = cpu_count();
+    int first_cpu = 0;
+
+    for (int node = 0; node < node_count(); node++) {
+        // Workers whose share of the machine falls in this node's CPUs.
+        first_cpu += int(m_node_cpus[node].size());
+        while (int(nodes.size()) < worker_count &&
+                int64_t(nodes.size())*total < int64_t(first_cpu)*worker_count) {
+
+            nodes.push_back(node);
+        }
+    }
+
+    return nodes;
+}
+
+// The CPUs in "cpus" in the order of "placement".
+static std::vector<int> place_cpus(const Topology &topology, const std::vector<int> &cpus,
+        Topology::Placement placement) {
+
+    // Siblings of each core, cores in order of their first CPU.
+    std::vector<std::vector<int>> cores;
+    for (int cpu : cpus) {
+        int core = topology.core_of(cpu);
+        size_t i = 0;
+        while (i < cores.size() && topology.core_of(cores[i][0]) != core) {
+            i++;
+        }
+        if (i == cores.size()) {
+            cores.push_back(std::vector<int>());
+        }
+        cores[i].push_back(cpu);
+    }
+
+    std::vector<int> placed;
+    if (placement == Topology::PLACEMENT_SIBLINGS) {
+        for (std::vector<int> const &siblings : cores) {
+            placed.insert(placed.end(), siblings.begin(), siblings.end());
+        }
+    } else {
+        for (size_t sibling = 0; placed.size() < cpus.size(); sibling++) {
+            for (std::vector<int> const &siblings : cores) {
+                if (sibling < siblings.size()) {
+                    placed.push_back(siblings[sibling]);
+                }
+            }
+        }
+    }
+
+    return placed;
+}
+
+std::vector<int> Topology::worker_cpus(int worker_count, Placement placement) const {
+    std::vector<int> nodes = worker_nodes(worker_count);
+    std::vector<int> cpus;
+    std::vector<int> next(node_count(), 0);
+
+    std::vector<std::vector<int>> node_cpus;
+    for (std::vector<int> const &unplaced : m_node_cpus) {
+        node_cpus.push_back(place_cpus(*this, unplaced, placement));
+    }
+
+    for (int node : nodes) {
+        cpus.push_back(node_cpus[node][next[node]++ % node_cpus[node].size()]);
+    }
+
+    return cpus;
+}
+
+const char *placement_name(Topology::Placement placement) {
+    return placement == Topology::PLACEMENT_SIBLINGS ? "siblings" : "cores";
+}
+
+bool parse_placement(const std::string &name, Topology::Placement &placement) {
+    if (name == "cores") {
+        placement = Topology::PLACEMENT_CORES;
+    } else if (name == "siblings") {
+        placement = Topology::PLACEMENT_SIBLINGS;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool pin_current_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
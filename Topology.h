@@ -0,0 +1,59 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Which CPUs we may run on, grouped by NUMA node, and which of them are
+ * SMT siblings on the same physical core. Read from sysfs on Linux.
+ * Elsewhere (or if sysfs isn't there) it's one node with every CPU, each
+ * its own core.
+ */
+class Topology {
+public:
+    // Order in which workers take a node's CPUs.
+    enum Placement {
+        // One per physical core, then the cores' second siblings, and so on.
+        PLACEMENT_CORES,
+        // Both siblings of a core, then the next core.
+        PLACEMENT_SIBLINGS,
+    };
+
+    // CPUs of each node that has any we're allowed to use.
+    std::vector<std::vector<int>> m_node_cpus;
+
+    // Physical core of each CPU, numbered by its first sibling.
+    std::vector<int> m_cpu_cores;
+
+    // Detect the machine's topology.
+    static Topology detect();
+
+    int node_count() const { return int(m_node_cpus.size()); }
+    int cpu_count() const;
+
+    // Physical cores with CPUs we may use.
+    int core_count() const;
+    bool has_smt() const { return core_count() < cpu_count(); }
+    int core_of(int cpu) const { return cpu < int(m_cpu_cores.size()) ? m_cpu_cores[cpu] : cpu; }
+
+    // CPU for each of "worker_count" workers. Workers are split into
+    // contiguous blocks, one per node, in proportion to the node's CPUs,
+    // and take the node's CPUs in the order of "placement".
+    std::vector<int> worker_cpus(int worker_count, Placement placement = PLACEMENT_CORES) const;
+
+    // Node of each of "worker_count" workers placed by worker_cpus().
+    std::vector<int> worker_nodes(int worker_count) const;
+};
+
+// Parse a sysfs CPU list such as "0-3,8-11".
+std::vector<int> parse_cpu_list(const std::string &list);
+
+// Name of a placement, and the reverse. Returns whether the name is known.
+const char *placement_name(Topology::Placement placement);
+bool parse_placement(const std::string &name, Topology::Placement &placement);
+
+// Pin the calling thread to a CPU. Returns whether successful.
+bool pin_current_thread(int cpu);
+
+#endif // TOPOLOGY_H
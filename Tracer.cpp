@@ -0,0 +1,792 @@
+
+#include <algorithm>
+#include <limits>
+#include "PerfCounters.h"
+#include "Ray.h"
+#include "SplatBuffer.h"
+#include "Timeline.h"
+#include "Tracer.h"
+
+static const float MIN_HIT_DIST = 0.001;
+
+// Height of the prism's sides.
+static const float PRISM_HEIGHT = 2;
+
+// Highest chance of surviving a round of Russian roulette. Less than one
+// so that full-weight photons trapped in the glass die out too.
+static const float MAX_ROULETTE_SURVIVAL = 0.9;
+
+// The fill light from above: the size of the square it shines from, its
+// height, and the size of the square on the paper it's aimed at, all
+// centered on the prism.
+static const double FILL_LIGHT_SIZE = 0.1;
+static const double FILL_LIGHT_HEIGHT = 10;
+static const double FILL_TARGET_SIZE = 1;
+
+// Paths in trace_paths() that carry less light than this are dropped.
+static const float MIN_PATH_WEIGHT = 1e-5;
+
+// Bounces whose path numbers trace_paths() can spell out exactly, at
+// three bits each. Deeper paths get hashed path numbers.
+static const int EXACT_PATH_BOUNCES = 21;
+
+// Most rays of a split photon waiting to be traced. When it's full, we
+// pick one way at random instead of splitting.
+static const int SPLIT_STACK_SIZE = 16;
+
+// Return the distance along the ray to hit this side of the prism.
+static float intersect_with_prism_side(Ray const &ray,
+        Vec3 const &p1, Vec3 const &p2, Vec3 const &n) {
+
+    Vec3 p = ray.origin() - p1;
+
+    // See if we're parallel to the side.
+    float denom = ray.direction().dot(n);
+    if (denom == 0) {
+        return -1;
+    }
+
+    // Distance to intersection.
+    float t = -(p.dot(n)) / denom;
+
+    if (t > MIN_HIT_DIST) {
+        // See if we're within the rectangle.
+        p = ray.point_at(t);
+
+        if (p.z() > PRISM_HEIGHT) {
+            return -1;
+        }
+
+        if (fabs(n.x()) > fabs(n.y())) {
+            // Vertical side. Project to Y axis.
+            if (p1.y() < p2.y()) {
+                if (p.y() < p1.y() || p.y() > p2.y()) {
+                    return -1;
+                }
+            } else {
+                if (p.y() < p2.y() || p.y() > p1.y()) {
+                    return -1;
+                }
+            }
+        } else {
+            // Horizontal side. Project to X axis.
+            if (p1.x() < p2.x()) {
+                if (p.x() < p1.x() || p.x() > p2.x()) {
+                    return -1;
+                }
+            } else {
+                if (p.x() < p2.x() || p.x() > p1.x()) {
+                    return -1;
+                }
+            }
+        }
+    } else {
+        t = -1;
+    }
+
+    return t;
+}
+
+// Approximate reflection coefficient.
+static float schlick(float cosine, float refraction_index) {
+    float r0 = (1 - refraction_index) / (1 + refraction_index);
+    r0 *= r0;
+    return r0 + (1 - r0)*pow(1 - cosine, 5);
+}
+
+// Get new ray from an intersection with glass, weighted by the share of
+// the light that follows it. With REFLECTIONS_SPLIT, if "can_split", the
+// reflected light may go into "split_out" instead of being dropped, and
+// we return true.
+template <Scene::Reflections REFLECTIONS>
+static bool hit_glass(Ray const &ray_in, Vec3 const &p, Vec3 const &n,
+        float refraction_index, Ray &ray_out, Ray &split_out, bool can_split) {
+
+    // Our ray's direction, normalized.
+    Vec3 dir = ray_in.direction().unit();
+
+    // We don't know whether we're inside the material or outside.
+    // Our hit normal will always point outward. We want a normal
+    // that points in the direction we came from.
+    Vec3 normal;
+    float ni_over_nt;
+    float cosine;
+    if (dir.dot(n) > 0) {
+        // We're inside. Reverse normal.
+        normal = -n;
+        ni_over_nt = refraction_index;
+        cosine = refraction_index*dir.dot(n);
+    } else {
+        // We're outside. Use normal as-is.
+        normal = n;
+        ni_over_nt = 1/refraction_index;
+        cosine = -dir.dot(n);
+    }
+
+    int wavelength = ray_in.wavelength();
+    float weight = ray_in.weight();
+
+    Vec3 refracted;
+    if (refract(dir, normal, ni_over_nt, refracted)) {
+        // We can refract. Figure out if we should.
+        if (REFLECTIONS == Scene::REFLECTIONS_SPLIT && can_split) {
+            // Both ways, each with its share.
+            float reflectance = schlick(cosine, refraction_index);
+            ray_out = Ray(p, refracted, wavelength, weight*(1 - reflectance));
+            split_out = Ray(p, reflect(dir, n), wavelength, weight*reflectance);
+            return true;
+        } else if (REFLECTIONS == Scene::REFLECTIONS_WEIGHTED) {
+            // Only the light that isn't reflected.
+            ray_out = Ray(p, refracted, wavelength, weight*(1 - schlick(cosine, refraction_index)));
+        } else if ((REFLECTIONS == Scene::REFLECTIONS_STOCHASTIC || REFLECTIONS == Scene::REFLECTIONS_SPLIT) &&
+                my_rand() < schlick(cosine, refraction_index)) {
+
+            Vec3 reflected = reflect(dir, n);
+            ray_out = Ray(p, reflected, wavelength, weight);
+        } else {
+            ray_out = Ray(p, refracted, wavelength, weight);
+        }
+    } else {
+        // Can't refract. Only reflect.
+        Vec3 reflected = reflect(dir, n);
+        ray_out = Ray(p, reflected, wavelength, weight);
+    }
+
+    return false;
+}
+
+// Lights. Each picks a photon's origin, a point it's aimed at, and its
+// wavelength in nanometers.
+
+/**
+ * Point light off to the left, shining through a slit.
+ */
+struct SlitLight {
+    static void emit(const Scene &scene, Vec3 &origin, Vec3 &target, int &wavelength) {
+        origin = scene.m_light_origin;
+        target = Vec3(-0.6, my_rand()*0.002 - 0.05, my_rand());
+        wavelength = (int) (380 + (700 - 380)*my_rand());
+        target += scene.m_offset;
+    }
+};
+
+/**
+ * Lights in a circle around the prism, aimed at it.
+ */
+struct RingLight {
+    static void emit(const Scene &scene, Vec3 &origin, Vec3 &target, int &wavelength) {
+        wavelength = (int) (380 + (700 - 380)*my_rand());
+        float angle = my_rand()*2*M_PI;
+        origin = Vec3(3*cos(angle), 3*sin(angle), 1);
+        target = Vec3(0, 0, my_rand()) + scene.m_offset;
+    }
+};
+
+/**
+ * Lights in a wide circle around the prism, aimed at a disc around its
+ * center.
+ */
+struct HaloLight {
+    static void emit(const Scene &scene, Vec3 &origin, Vec3 &target, int &wavelength) {
+        wavelength = (int) (380 + (700 - 380)*my_rand());
+        float y = scene.m_center.y();
+        float angle = my_rand()*2*M_PI;
+        origin = Vec3(30*cos(angle), 30*sin(angle) + y, 1);
+        float target_angle = my_rand()*2*M_PI;
+        target = Vec3(0.5*cos(target_angle), 0.5*sin(target_angle) + y, my_rand());
+    }
+};
+
+// See if the ray hits this side of the prism closer than "best_t". If so,
+// update the best hit and return true.
+static inline bool closer_prism_side(Ray const &ray, Vec3 const &p1, Vec3 const &p2,
+        Vec3 const &n, float &best_t, Vec3 &best_p, Vec3 &best_n) {
+
+    float t = intersect_with_prism_side(ray, p1, p2, n);
+    if (t > MIN_HIT_DIST && t < best_t) {
+        Vec3 p = ray.point_at(t);
+        if (p.z() > 0) {
+            best_t = t;
+            best_p = p;
+            best_n = n;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Where the photons that land go. Each gets a photon's position on the
+// paper, in pixels from the lower-left corner, and its color.
+
+/**
+ * Adds photons to the pixel they land in. Straight into a worker's own
+ * image, which is fastest while the image fits in the cache, or through
+ * a SplatBuffer into a shared one, so that each tile lock is taken once
+ * per run of hits rather than once per hit. Hits on a tiled image also
+ * mark their tile dirty, for the running sum.
+ */
+template <Accumulator::Layout LAYOUT, bool SHARED>
+class SplatTarget {
+public:
+    typedef Accumulator Image;
+
+    SplatTarget(Accumulator &image, const Scene &scene)
+        : m_width(scene.m_width), m_height(scene.m_height), m_image(image), m_splats(image) {
+
+        // Nothing.
+    }
+
+    void land(Vec3 const &p, int wavelength, float weight) {
+        int x = (int) (p.x() + 0.5);
+        int y = m_height - 1 - (int) (p.y() + 0.5);
+
+        if (x >= 0 && y >= 0 && x < m_width && y < m_height) {
+            Vec3 rgb = wavelength2rgb(wavelength)*(0.001*weight);
+
+            if (SHARED) {
+                m_splats.add_as<LAYOUT>(x, y, rgb);
+            } else if (LAYOUT == Accumulator::LAYOUT_TILED) {
+                m_image.add_to_tile(m_image.pixel_index_as<LAYOUT>(x, y), rgb.r(), rgb.g(), rgb.b());
+            } else {
+                m_image.add(m_image.pixel_index_as<LAYOUT>(x, y), rgb.r(), rgb.g(), rgb.b());
+            }
+        }
+    }
+
+    void flush() {
+        if (SHARED) {
+            m_splats.flush();
+        }
+    }
+
+private:
+    int m_width;
+    int m_height;
+    Accumulator &m_image;
+    // Hits on a shared image go through here, in tile order.
+    SplatBuffer m_splats;
+};
+
+/**
+ * Keeps where each photon landed, for the photon map.
+ */
+class HitTarget {
+public:
+    typedef std::vector<PhotonHit> Image;
+
+    HitTarget(std::vector<PhotonHit> &hits, const Scene &scene)
+        : m_width(scene.m_width), m_height(scene.m_height), m_hits(hits) {
+
+        // Nothing.
+    }
+
+    void land(Vec3 const &p, int wavelength, float weight) {
+        // Same pixel centers as SplatTarget, with y going down.
+        float x = p.x();
+        float y = m_height - 1 - p.y();
+
+        if (x >= -MAX_PHOTON_RADIUS && y >= -MAX_PHOTON_RADIUS &&
+                x < m_width + MAX_PHOTON_RADIUS && y < m_height + MAX_PHOTON_RADIUS) {
+
+            Vec3 rgb = wavelength2rgb(wavelength)*(0.001*weight);
+            m_hits.push_back(PhotonHit{x, y, {rgb.r(), rgb.g(), rgb.b()}});
+        }
+    }
+
+    void flush() {
+        // Nothing.
+    }
+
+private:
+    int m_width;
+    int m_height;
+    std::vector<PhotonHit> &m_hits;
+};
+
+// The photon tracing loop, specialized for a kind of light, whether there's
+// fill light from above, whether glass reflects, where photons go, and
+// what counts the time it takes.
+template <class Light, bool FILL_LIGHT, Scene::Reflections REFLECTIONS, class Target, class Profiler>
+static void trace(const Scene &scene, typename Target::Image &image, int64_t count, uint64_t seed,
+        TraceStats &stats) {
+    // Initialize the seed for our thread.
+    init_rand(seed);
+
+    int width = scene.m_width;
+    int height = scene.m_height;
+
+    Vec3 const &p0 = scene.m_p0;
+    Vec3 const &p1 = scene.m_p1;
+    Vec3 const &p2 = scene.m_p2;
+    Vec3 const &n01 = scene.m_n01;
+    Vec3 const &n12 = scene.m_n12;
+    Vec3 const &n20 = scene.m_n20;
+
+    Target target(image, scene);
+    Profiler profiler;
+
+    int max_bounces = scene.m_max_bounces;
+    int roulette_bounces = scene.m_roulette_bounces;
+
+    int64_t bounces = 0;
+    int64_t landed = 0;
+    int64_t deep_bounces = 0;
+    int64_t roulette_drops = 0;
+    int64_t bounce_limit_drops = 0;
+
+    for (int64_t photon = 0; photon < count; photon++) {
+        profiler.enter(PHASE_RNG);
+
+        Vec3 ray_origin;
+        Vec3 ray_target;
+        int wavelength;
+        Light::emit(scene, ray_origin, ray_target, wavelength);
+
+        // Occasionally send some light from above, to highlight the prism itself.
+        if (FILL_LIGHT && my_rand() < FILL_LIGHT_SHARE) {
+            Vec3 const &p_avg = scene.m_center;
+            ray_origin = p_avg + Vec3((my_rand() - 0.5)*FILL_LIGHT_SIZE,
+                    (my_rand() - 0.5)*FILL_LIGHT_SIZE, FILL_LIGHT_HEIGHT);
+            ray_target = p_avg + Vec3((my_rand() - 0.5)*FILL_TARGET_SIZE,
+                    (my_rand() - 0.5)*FILL_TARGET_SIZE, 0);
+        }
+
+        // Same for every bounce.
+        float refraction_index = scene.refraction_index(wavelength);
+
+        // Rays of this photon left to trace, the bounces each has taken,
+        // and whether the last one reflected it. Only REFLECTIONS_SPLIT
+        // ever has more than one.
+        Ray rays[SPLIT_STACK_SIZE];
+        int ray_bounces[SPLIT_STACK_SIZE];
+        bool ray_reflected[SPLIT_STACK_SIZE];
+        rays[0] = Ray(ray_origin, (ray_target - ray_origin).unit(), wavelength);
+        ray_bounces[0] = 0;
+        ray_reflected[0] = false;
+        int ray_count = 1;
+
+        while (ray_count > 0) {
+            ray_count--;
+            Ray ray = rays[ray_count];
+            bool reflected = ray_reflected[ray_count];
+
+            for (int bounce = ray_bounces[ray_count]; ; bounce++) {
+                profiler.enter(PHASE_INTERSECT);
+
+                // Closest side of the prism, if any.
+                float best_t = std::numeric_limits<float>::max();
+                Vec3 best_p;
+                Vec3 best_n;
+                bool hit_prism = closer_prism_side(ray, p0, p1, n01, best_t, best_p, best_n);
+                hit_prism |= closer_prism_side(ray, p1, p2, n12, best_t, best_p, best_n);
+                hit_prism |= closer_prism_side(ray, p2, p0, n20, best_t, best_p, best_n);
+
+                // See if we hit the paper first.
+                float dz = ray.m_direction.z();
+                if (dz != 0) {
+                    float t = -ray.m_origin.z()/dz;
+
+                    if (t > MIN_HIT_DIST && t < best_t) {
+                        // Landed on paper, leave a spot.
+                        Vec3 p = (ray.point_at(t)*ZOOM + Vec3(0.5, height/2.0/width, 0))*width;
+                        profiler.enter(PHASE_SPLAT);
+                        target.land(p, wavelength, ray.weight());
+                        landed++;
+                        break;
+                    }
+                }
+
+                if (!hit_prism) {
+                    // Didn't intersect anything.
+                    break;
+                }
+
+                profiler.enter(PHASE_GLASS);
+
+                if (bounce >= max_bounces) {
+                    bounce_limit_drops++;
+                    break;
+                }
+
+                // Only reflected light plays Russian roulette, so that the
+                // beams that refract through the glass stay noise-free.
+                if (bounce >= roulette_bounces) {
+                    if (reflected) {
+                        float survival = std::min(ray.weight(), MAX_ROULETTE_SURVIVAL);
+                        if (my_rand() >= survival) {
+                            roulette_drops++;
+                            break;
+                        }
+                        ray.m_weight /= survival;
+                    }
+                    deep_bounces++;
+                }
+
+                // The reflected ray goes into "split_out" rather than
+                // straight onto the stack, which may be full.
+                Ray ray_out;
+                Ray split_out;
+                if (hit_glass<REFLECTIONS>(ray, best_p, best_n, refraction_index,
+                            ray_out, split_out, ray_count < SPLIT_STACK_SIZE)) {
+
+                    rays[ray_count] = split_out;
+                    ray_bounces[ray_count] = bounce + 1;
+                    ray_reflected[ray_count] = true;
+                    ray_count++;
+                }
+
+                // Reflected if it stayed on the same side of the glass.
+                reflected = (ray.m_direction.dot(best_n) > 0) != (ray_out.m_direction.dot(best_n) > 0);
+                ray = ray_out;
+                bounces++;
+            }
+        }
+    }
+
+    profiler.enter(PHASE_SPLAT);
+    target.flush();
+    profiler.finish(count);
+
+    stats.m_bounces += bounces;
+    stats.m_landed += landed;
+    stats.m_deep_bounces += deep_bounces;
+    stats.m_roulette_drops += roulette_drops;
+    stats.m_bounce_limit_drops += bounce_limit_drops;
+}
+
+Vec3 paper_point(const Scene &scene, float x, float y) {
+    int width = scene.m_width;
+    int height = scene.m_height;
+
+    return Vec3(x/width - 0.5, (height - 1 - y)/width - height/2.0/width, 0)/ZOOM;
+}
+
+// Distance on the paper from "p" to the side from "a" to "b".
+static float distance_to_side(Vec3 const &p, Vec3 const &a, Vec3 const &b) {
+    Vec3 ab = b - a;
+    float s = std::min(std::max((p - a).dot(ab)/ab.dot(ab), 0.0f), 1.0f);
+
+    return (p - (a + s*ab)).length();
+}
+
+void trace_fill_rows(const Scene &scene, int samples, uint64_t seed,
+        float *image, int y_begin, int y_end) {
+
+    init_rand(seed);
+
+    int width = scene.m_width;
+    Vec3 const &center = scene.m_center;
+
+    // Share of the fill light that a pixel gets from each photon, before
+    // the glass moves it around.
+    double pixel_size = 1/(ZOOM*width);
+    double pixel_share = FILL_LIGHT_SHARE*pixel_size*pixel_size/(FILL_TARGET_SIZE*FILL_TARGET_SIZE);
+    float sample_weight = 0.001*pixel_share/(samples*samples);
+
+    // What a pixel gets when no path to it touches the glass: the average
+    // color of the photons' wavelengths.
+    Vec3 open_rgb = VEC3_BLACK;
+    for (int wavelength = 380; wavelength < 700; wavelength++) {
+        open_rgb += wavelength2rgb(wavelength);
+    }
+    open_rgb *= 0.001*pixel_share/(700 - 380);
+
+    float *rgb = image;
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = 0; x < width; x++) {
+            // Most pixels are far enough from the sides that no ray from
+            // them to the light gets near the glass. Skip tracing those.
+            Vec3 pixel = paper_point(scene, x, y);
+            Vec3 from_center = pixel - center;
+            float reach = (from_center.length() + FILL_LIGHT_SIZE)*PRISM_HEIGHT/FILL_LIGHT_HEIGHT + pixel_size;
+            float margin = FILL_TARGET_SIZE/2 - pixel_size;
+            if (distance_to_side(pixel, scene.m_p0, scene.m_p1) > reach &&
+                    distance_to_side(pixel, scene.m_p1, scene.m_p2) > reach &&
+                    distance_to_side(pixel, scene.m_p2, scene.m_p0) > reach &&
+                    fabs(from_center.x()) < margin && fabs(from_center.y()) < margin) {
+
+                rgb[0] = open_rgb.r();
+                rgb[1] = open_rgb.g();
+                rgb[2] = open_rgb.b();
+                rgb += 3;
+                continue;
+            }
+
+            Vec3 sum = VEC3_BLACK;
+
+            // Stratified over the pixel.
+            for (int i = 0; i < samples*samples; i++) {
+                // Back from the paper, the reverse of where photons land.
+                float px = x + ((i % samples) + my_rand())/samples - 0.5;
+                float py = y - ((i / samples) + my_rand())/samples + 0.5;
+                Vec3 p = paper_point(scene, px, py);
+
+                // Outside the square that the fill light is aimed at.
+                if (fabs(p.x() - center.x()) > FILL_TARGET_SIZE/2 ||
+                        fabs(p.y() - center.y()) > FILL_TARGET_SIZE/2) {
+
+                    continue;
+                }
+
+                // Stratified over the spectrum too, in transposed order,
+                // so that every pixel gets all the colors.
+                int stratum = (i % samples)*samples + i/samples;
+                int wavelength = (int) (380 + (700 - 380)*(stratum + my_rand())/(samples*samples));
+                float refraction_index = scene.refraction_index(wavelength);
+
+                // Paths through glass are reversible, so trace from the
+                // paper toward a point on the light, and see if the ray
+                // still gets there.
+                Vec3 light = center + Vec3((my_rand() - 0.5)*FILL_LIGHT_SIZE,
+                        (my_rand() - 0.5)*FILL_LIGHT_SIZE, FILL_LIGHT_HEIGHT);
+                Ray ray(p, (light - p).unit(), wavelength);
+
+                for (int bounce = 0; bounce < scene.m_max_bounces; bounce++) {
+                    float best_t = std::numeric_limits<float>::max();
+                    Vec3 best_p;
+                    Vec3 best_n;
+                    bool hit_prism = closer_prism_side(ray, scene.m_p0, scene.m_p1, scene.m_n01,
+                            best_t, best_p, best_n);
+                    hit_prism |= closer_prism_side(ray, scene.m_p1, scene.m_p2, scene.m_n12,
+                            best_t, best_p, best_n);
+                    hit_prism |= closer_prism_side(ray, scene.m_p2, scene.m_p0, scene.m_n20,
+                            best_t, best_p, best_n);
+
+                    if (!hit_prism) {
+                        // Out in the open. See if it reaches the light.
+                        float dz = ray.m_direction.z();
+                        if (dz > 0) {
+                            Vec3 q = ray.point_at((FILL_LIGHT_HEIGHT - ray.m_origin.z())/dz) - center;
+                            if (fabs(q.x()) <= FILL_LIGHT_SIZE/2 && fabs(q.y()) <= FILL_LIGHT_SIZE/2) {
+                                sum += wavelength2rgb(wavelength)*ray.weight();
+                            }
+                        }
+                        break;
+                    }
+
+                    // Only the light that refracts follows the path back.
+                    Ray ray_out;
+                    Ray unused;
+                    hit_glass<Scene::REFLECTIONS_WEIGHTED>(ray, best_p, best_n, refraction_index,
+                            ray_out, unused, false);
+                    ray = ray_out;
+                }
+            }
+
+            rgb[0] = sum.r()*sample_weight;
+            rgb[1] = sum.g()*sample_weight;
+            rgb[2] = sum.b()*sample_weight;
+            rgb += 3;
+        }
+    }
+}
+
+// Path number for a path that hit "side" at this bounce after following
+// "path", and either went through or reflected.
+static uint64_t extend_path(uint64_t path, int bounce, int side, bool through) {
+    // Three bits per bounce: the side, and whether we went through.
+    uint64_t step = (side << 1) | (through ? 1 : 0);
+    if (bounce < EXACT_PATH_BOUNCES) {
+        return (path << 3) | step;
+    }
+
+    // Out of bits, so mix the path (splitmix64's finalizer) before adding
+    // the step. Two paths of the same depth then share a number only by
+    // chance, about one in 2^61.
+    path = (path ^ (path >> 30))*0xBF58476D1CE4E5B9ull;
+    path = (path ^ (path >> 27))*0x94D049BB133111EBull;
+    path ^= path >> 31;
+
+    return path ^ step;
+}
+
+void trace_paths(const Scene &scene, Vec3 const &origin, Vec3 const &target, int wavelength,
+        std::vector<PathLanding> &landings) {
+
+    int width = scene.m_width;
+    int height = scene.m_height;
+    float refraction_index = scene.refraction_index(wavelength);
+
+    // Paths left to follow, like the split photon's rays in trace(), but
+    // with no limit, so that every path is followed both ways. Kept from
+    // call to call, since there are many calls with few paths each.
+    struct PendingPath {
+        Ray m_ray;
+        uint64_t m_path;
+        int m_bounces;
+    };
+    static thread_local std::vector<PendingPath> pending;
+    pending.push_back(PendingPath{Ray(origin, (target - origin).unit(), wavelength), 0, 0});
+
+    while (!pending.empty()) {
+        Ray ray = pending.back().m_ray;
+        uint64_t path = pending.back().m_path;
+        int first_bounce = pending.back().m_bounces;
+        pending.pop_back();
+
+        for (int bounce = first_bounce; ; bounce++) {
+            float best_t = std::numeric_limits<float>::max();
+            Vec3 best_p;
+            Vec3 best_n;
+            int side = 0;
+            if (closer_prism_side(ray, scene.m_p0, scene.m_p1, scene.m_n01, best_t, best_p, best_n)) {
+                side = 1;
+            }
+            if (closer_prism_side(ray, scene.m_p1, scene.m_p2, scene.m_n12, best_t, best_p, best_n)) {
+                side = 2;
+            }
+            if (closer_prism_side(ray, scene.m_p2, scene.m_p0, scene.m_n20, best_t, best_p, best_n)) {
+                side = 3;
+            }
+
+            float dz = ray.m_direction.z();
+            if (dz != 0) {
+                float t = -ray.m_origin.z()/dz;
+
+                if (t > MIN_HIT_DIST && t < best_t) {
+                    Vec3 p = (ray.point_at(t)*ZOOM + Vec3(0.5, height/2.0/width, 0))*width;
+                    landings.push_back(PathLanding{path, bounce, p.x(), height - 1 - p.y(), ray.weight()});
+                    break;
+                }
+            }
+
+            if (side == 0 || bounce >= scene.m_max_bounces || ray.weight() < MIN_PATH_WEIGHT) {
+                break;
+            }
+
+            // Both ways if the mode reflects at all, each with its share.
+            Ray ray_out;
+            Ray split_out;
+            bool split;
+            if (scene.m_reflections == Scene::REFLECTIONS_NONE) {
+                split = hit_glass<Scene::REFLECTIONS_NONE>(ray, best_p, best_n, refraction_index,
+                        ray_out, split_out, false);
+            } else if (scene.m_reflections == Scene::REFLECTIONS_WEIGHTED) {
+                split = hit_glass<Scene::REFLECTIONS_WEIGHTED>(ray, best_p, best_n, refraction_index,
+                        ray_out, split_out, false);
+            } else {
+                split = hit_glass<Scene::REFLECTIONS_SPLIT>(ray, best_p, best_n, refraction_index,
+                        ray_out, split_out, true);
+            }
+
+            bool through = (ray.m_direction.dot(best_n) > 0) == (ray_out.m_direction.dot(best_n) > 0);
+            uint64_t next_path = extend_path(path, bounce, side, through);
+            if (split) {
+                pending.push_back(PendingPath{split_out, extend_path(path, bounce, side, false), bounce + 1});
+            }
+            ray = ray_out;
+            path = next_path;
+        }
+    }
+}
+
+// Pick the specialization, one feature at a time. The last choice, where
+// photons go, is made by "Pick".
+
+/**
+ * Picks the loop that adds photons to an accumulator with this layout,
+ * shared or not, profiled by "Profiler".
+ */
+template <class Profiler>
+struct PickSplatTarget {
+    template <class Light, bool FILL_LIGHT, Scene::Reflections REFLECTIONS>
+    struct For {
+        typedef TraceFunction Function;
+
+        template <Accumulator::Layout LAYOUT>
+        static Function pick_for_layout(bool shared) {
+            return shared ?
+                trace<Light, FILL_LIGHT, REFLECTIONS, SplatTarget<LAYOUT, true>, Profiler> :
+                trace<Light, FILL_LIGHT, REFLECTIONS, SplatTarget<LAYOUT, false>, Profiler>;
+        }
+
+        static Function pick(Accumulator::Layout layout, bool shared) {
+            return layout == Accumulator::LAYOUT_LINEAR ?
+                pick_for_layout<Accumulator::LAYOUT_LINEAR>(shared) :
+                pick_for_layout<Accumulator::LAYOUT_TILED>(shared);
+        }
+    };
+};
+
+/**
+ * Picks the loop that keeps photon hits.
+ */
+template <class Light, bool FILL_LIGHT, Scene::Reflections REFLECTIONS>
+struct PickHitTarget {
+    typedef HitTraceFunction Function;
+
+    static Function pick(Accumulator::Layout, bool) {
+        return trace<Light, FILL_LIGHT, REFLECTIONS, HitTarget, NoProfiler>;
+    }
+};
+
+// Type of the functions that "Pick" picks.
+template <template <class, bool, Scene::Reflections> class Pick>
+using PickedFunction = typename Pick<SlitLight, true, Scene::REFLECTIONS_STOCHASTIC>::Function;
+
+template <template <class, bool, Scene::Reflections> class Pick, class Light, bool FILL_LIGHT>
+static PickedFunction<Pick> tracer_for_reflections(const Scene &scene, Accumulator::Layout layout,
+        bool shared) {
+
+    switch (scene.m_reflections) {
+        case Scene::REFLECTIONS_STOCHASTIC:
+        default:
+            return Pick<Light, FILL_LIGHT, Scene::REFLECTIONS_STOCHASTIC>::pick(layout, shared);
+
+        case Scene::REFLECTIONS_NONE:
+            return Pick<Light, FILL_LIGHT, Scene::REFLECTIONS_NONE>::pick(layout, shared);
+
+        case Scene::REFLECTIONS_WEIGHTED:
+            return Pick<Light, FILL_LIGHT, Scene::REFLECTIONS_WEIGHTED>::pick(layout, shared);
+
+        case Scene::REFLECTIONS_SPLIT:
+            return Pick<Light, FILL_LIGHT, Scene::REFLECTIONS_SPLIT>::pick(layout, shared);
+    }
+}
+
+template <template <class, bool, Scene::Reflections> class Pick, class Light>
+static PickedFunction<Pick> tracer_for_fill_light(const Scene &scene, Accumulator::Layout layout,
+        bool shared) {
+
+    return scene.m_fill_light ?
+        tracer_for_reflections<Pick, Light, true>(scene, layout, shared) :
+        tracer_for_reflections<Pick, Light, false>(scene, layout, shared);
+}
+
+template <template <class, bool, Scene::Reflections> class Pick>
+static PickedFunction<Pick> tracer_for_light(const Scene &scene, Accumulator::Layout layout,
+        bool shared) {
+
+    switch (scene.m_light) {
+        case Scene::LIGHT_SLIT:
+        default:
+            return tracer_for_fill_light<Pick, SlitLight>(scene, layout, shared);
+
+        case Scene::LIGHT_RING:
+            return tracer_for_fill_light<Pick, RingLight>(scene, layout, shared);
+
+        case Scene::LIGHT_HALO:
+            return tracer_for_fill_light<Pick, HaloLight>(scene, layout, shared);
+    }
+}
+
+TraceFunction tracer_for(const Scene &scene, Accumulator::Layout layout, bool shared) {
+    return tracer_for_light<PickSplatTarget<NoProfiler>::For>(scene, layout, shared);
+}
+
+TraceFunction profiled_tracer_for(const Scene &scene, Accumulator::Layout layout, bool shared) {
+    return tracer_for_light<PickSplatTarget<CounterProfiler>::For>(scene, layout, shared);
+}
+
+TraceFunction timed_tracer_for(const Scene &scene, Accumulator::Layout layout, bool shared) {
+#ifdef TIMELINE
+    return tracer_for_light<PickSplatTarget<TimerProfiler>::For>(scene, layout, shared);
+#else
+    return tracer_for(scene, layout, shared);
+#endif
+}
+
+HitTraceFunction hit_tracer_for(const Scene &scene) {
+    return tracer_for_light<PickHitTarget>(scene, Accumulator::LAYOUT_LINEAR, false);
+}
@@ -0,0 +1,108 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <stdint.h>
+#include <vector>
+#include "Accumulator.h"
+#include "Scene.h"
+
+// How much to zoom into the center of the image (to make the prism look larger).
+static const float ZOOM = 2;
+
+/**
+ * What happened to the photons, added to by the tracer.
+ */
+struct TraceStats {
+    // Times a photon hit glass.
+    int64_t m_bounces;
+    // Rays that landed on the paper (in the image or not). A split photon
+    // can land in several places.
+    int64_t m_landed;
+    // Bounces after the scene's m_roulette_bounces, in deep paths.
+    int64_t m_deep_bounces;
+    // Rays dropped by Russian roulette.
+    int64_t m_roulette_drops;
+    // Rays dropped for reaching the scene's m_max_bounces.
+    int64_t m_bounce_limit_drops;
+};
+
+// Trace "count" photons from the light through the scene, adding their
+// color to "image" where they land on the paper, and counting what
+// happened in "stats". The same seed always gives the same photons.
+typedef void (*TraceFunction)(const Scene &scene, Accumulator &image, int64_t count, uint64_t seed,
+        TraceStats &stats);
+
+// Tracing loop compiled for the scene's light and features, for an
+// accumulator layout, and for whether workers share the accumulator
+// (see Accumulator::share()). Pick it once and use it for every batch;
+// scenes that only differ in their numbers can share it.
+TraceFunction tracer_for(const Scene &scene, Accumulator::Layout layout, bool shared);
+
+// Same, but the loop also counts each thread's hardware events, in all
+// and by phase, in its PerfCounters. Slower, for profiling.
+TraceFunction profiled_tracer_for(const Scene &scene, Accumulator::Layout layout, bool shared);
+
+// Same, but the loop adds each batch to the timeline, with the time spent
+// in each phase. Without timeline support, the same as tracer_for().
+TraceFunction timed_tracer_for(const Scene &scene, Accumulator::Layout layout, bool shared);
+
+// Hits farther than this many pixels outside the image are dropped. Also
+// the largest photon map radius.
+static const float MAX_PHOTON_RADIUS = 64;
+
+/**
+ * Where a photon landed on the paper, in pixels from the upper-left
+ * corner (pixel centers are whole numbers), and its color.
+ */
+struct PhotonHit {
+    float m_x;
+    float m_y;
+    float m_rgb[3];
+};
+
+// Same as TraceFunction, but appends where the photons landed to "hits"
+// instead of adding them to an image.
+typedef void (*HitTraceFunction)(const Scene &scene, std::vector<PhotonHit> &hits, int64_t count,
+        uint64_t seed, TraceStats &stats);
+
+// Same as tracer_for(), for the photon map.
+HitTraceFunction hit_tracer_for(const Scene &scene);
+
+// Share of the photons that the fill light from above gets, when it's on.
+static const double FILL_LIGHT_SHARE = 0.10;
+
+/**
+ * Where light that took one path through the glass landed on the paper,
+ * in the same pixels as PhotonHit, and the share of the light that took
+ * it. Landings with the same path number and bounce count hit the same
+ * sides of the prism in the same order and went the same way at each.
+ * Past 21 bounces the path number is a hash, so that holds all but
+ * certainly rather than always.
+ */
+struct PathLanding {
+    uint64_t m_path;
+    int m_bounces;
+    float m_x;
+    float m_y;
+    float m_weight;
+};
+
+// Follow light of this wavelength from "origin" toward "target" down
+// every path that the scene's reflection mode allows, with no randomness,
+// appending where each one lands to "landings". Paths that carry almost
+// no light are dropped.
+void trace_paths(const Scene &scene, Vec3 const &origin, Vec3 const &target, int wavelength,
+        std::vector<PathLanding> &landings);
+
+// Point on the paper in pixel x, y of the image, where pixel centers are
+// whole numbers. The reverse of where photons land.
+Vec3 paper_point(const Scene &scene, float x, float y);
+
+// Render the fill light from above for rows [y_begin, y_end) from the
+// camera's side, with samples*samples view rays per pixel, into "image"
+// (row-major RGB, first row y_begin). Each pixel gets the light that the
+// photon fill light would leave there per photon traced.
+void trace_fill_rows(const Scene &scene, int samples, uint64_t seed,
+        float *image, int y_begin, int y_end);
+
+#endif // TRACER_H
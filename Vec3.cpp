@@ -6,16 +6,36 @@ static Vec3 VEC3_XY_ONES = Vec3(1, 1, 0);
 // Thread-local state for our random number generator.
 thread_local unsigned short g_xsubi[3];
 
-void init_rand(int seed) {
+// Thread-local state for the rounding stream, a splitmix64 counter.
+thread_local uint64_t g_rounding_state;
+
+void init_rand(uint64_t seed) {
+    // Mix the seed (splitmix64) so that nearby seeds give unrelated streams.
+    seed += 0x9E3779B97F4A7C15ull;
+    seed = (seed ^ (seed >> 30))*0xBF58476D1CE4E5B9ull;
+    seed = (seed ^ (seed >> 27))*0x94D049BB133111EBull;
+    seed ^= seed >> 31;
+
     g_xsubi[0] = seed;
-    g_xsubi[1] = seed;
-    g_xsubi[2] = seed;
+    g_xsubi[1] = seed >> 16;
+    g_xsubi[2] = seed >> 32;
+    g_rounding_state = seed;
 }
 
 float my_rand() {
     return erand48(g_xsubi);
 }
 
+double rounding_rand() {
+    uint64_t z = g_rounding_state += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBull;
+    z ^= z >> 31;
+
+    // The top 53 bits, as a double.
+    return (z >> 11)*(1.0/(uint64_t(1) << 53));
+}
+
 Vec3 random_in_unit_sphere() {
     Vec3 p;
 
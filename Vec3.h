@@ -3,6 +3,7 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <iostream>
 
 /**
@@ -151,7 +152,12 @@ void vector_to_polar(const Vec3 &p, float &u, float &v);
 
 // Thread-safe version of drand48(). Returns [0,1).
 float my_rand();
-void init_rand(int seed);
+void init_rand(uint64_t seed);
+
+// Random numbers for rounding fixed-point values, from a stream of their
+// own so that rounding doesn't change which photons are traced. Seeded by
+// init_rand() too. Returns [0,1).
+double rounding_rand();
 
 // Color functions.
 Vec3 hsv2rgb(const Vec3 &hsv);
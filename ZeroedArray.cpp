@@ -0,0 +1,27 @@
+
+#include <sys/mman.h>
+#include <new>
+#include "ZeroedArray.h"
+
+// Size of a transparent huge page on x86-64 and most ARM64 kernels.
+static const size_t HUGE_PAGE_SIZE = 2*1024*1024;
+
+void *map_zeroed(size_t size, size_t &mapped_size) {
+    // Round up to whole huge pages.
+    mapped_size = (size + HUGE_PAGE_SIZE - 1)/HUGE_PAGE_SIZE*HUGE_PAGE_SIZE;
+
+    void *p = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    // Only a hint. Fine if the kernel doesn't do huge pages.
+    madvise(p, mapped_size, MADV_HUGEPAGE);
+#endif
+
+    return p;
+}
+
+void unmap_zeroed(void *p, size_t mapped_size) {
+    munmap(p, mapped_size);
+}
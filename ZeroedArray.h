@@ -0,0 +1,49 @@
+#ifndef ZEROED_ARRAY_H
+#define ZEROED_ARRAY_H
+
+#include <stddef.h>
+
+// Map "size" bytes of zeroed memory straight from the kernel, rounded up
+// to whole huge pages (the rounded size goes in "mapped_size"), with a
+// hint to use transparent huge pages. Throws std::bad_alloc on failure.
+void *map_zeroed(size_t size, size_t &mapped_size);
+
+// Unmap memory from map_zeroed().
+void unmap_zeroed(void *p, size_t mapped_size);
+
+/**
+ * Array that starts out zeroed without being touched. Allocating a large
+ * image with new[]() makes the allocating thread write every page, which
+ * takes a noticeable part of a second for a full-size image and puts all
+ * of its memory on that thread's NUMA node. Pages of this one are only
+ * backed when they're first written, on the node of whoever writes them.
+ */
+template <typename T>
+class ZeroedArray {
+public:
+    explicit ZeroedArray(size_t count)
+        : m_data(static_cast<T *>(map_zeroed(count*sizeof(T), m_mapped_size))),
+          m_count(count) {
+
+        // Nothing.
+    }
+
+    ~ZeroedArray() {
+        unmap_zeroed(m_data, m_mapped_size);
+    }
+
+    T *data() { return m_data; }
+    const T *data() const { return m_data; }
+    size_t size() const { return m_count; }
+
+private:
+    size_t m_mapped_size;
+    T *m_data;
+    size_t m_count;
+
+    // Not copyable.
+    ZeroedArray(const ZeroedArray &);
+    ZeroedArray &operator=(const ZeroedArray &);
+};
+
+#endif // ZEROED_ARRAY_H
@@ -10,15 +10,37 @@
 
 #include <iostream>
 #include <sstream>
+#include <string>
 #include <iomanip>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <thread>
 #include <vector>
-#include <limits>
 #include <chrono>
 #include <atomic>
+#include <memory>
 #include <unistd.h>
-#include "Ray.h"
+#include <signal.h>
+#include <sys/resource.h>
+#include "AccumulatorFile.h"
+#include "BeamRender.h"
+#include "FillLight.h"
+#include "FrameQueue.h"
+#include "ImageFiles.h"
+#include "PerfCounters.h"
+#include "PhotonMap.h"
+#include "Regression.h"
+#include "RunningSum.h"
+#include "Scheduler.h"
+#include "SharedFrame.h"
+#include "SplatBenchmark.h"
+#include "ThreadScaling.h"
+#include "Timeline.h"
+#include "ToneOperator.h"
+#include "Topology.h"
+#include "Tracer.h"
 
 #ifdef DISPLAY
 #include "MiniFB.h"
@@ -26,476 +48,1577 @@
 
 #include "stb_image_write.h"
 
-// Define this to have a UI pop up with the image in progress (Mac only).
-#undef UPDATE_DISPLAY
+// Whether to show the image in progress in a window (needs DISPLAY).
+static bool g_update_display;
 
-// Size of the output image. Divide by 5 for in-progress work.
-static const int WIDTH = 3300;
-static const int HEIGHT = 4200;
-static const int PIXEL_COUNT = WIDTH*HEIGHT;
-static const float PRISM_WIDTH = 0.3;
-static const float MIN_HIT_DIST = 0.001;
-static const float GAMMA = 1/2.2;
+// Seconds between PNG saves, or 0 to not save.
+static int g_png_interval = 60;
 
-// How much to zoom into the center of the image (to make the prism look larger).
-static const float ZOOM = 2;
+// Name of the shared memory segment to publish frames in, or empty.
+static std::string g_shm_name;
 
-// Whether to quit the program.
-static bool g_quit;
+// Prefix of output image pathnames.
+static std::string g_output_prefix = "out4";
 
-// Number of threads to use.
+// Scene to render, or the first frame of a sequence.
+static Scene g_scene;
+
+// Tracing loop for the scene.
+static TraceFunction g_tracer;
+
+// Whether the tracing loop reads the hardware counters.
+static bool g_perf_counters;
+
+// Where to save the timeline of what each thread did, or empty.
+static std::string g_timeline_pathname;
+
+// Brightness of the fill light rendered from the camera's side, or 0 to
+// leave it to the photons.
+static float g_fill_pass;
+
+// Starting radius in pixels of the photon map, or 0 to add photons to
+// the pixel they land in.
+static float g_photon_radius;
+
+// Parameters to sweep across a sequence.
+static std::vector<SceneSweep> g_sweeps;
+
+// Number of frames in the sequence, or 0 to render a single image.
+static int g_frame_count;
+
+// Photons per frame, or -1 to render until asked to quit.
+static int64_t g_photons = -1;
+
+// Seed for the photons. The same seed gives the same image.
+static uint64_t g_seed = 1;
+
+// Layout and number format of the accumulators.
+static Accumulator::Layout g_layout = Accumulator::LAYOUT_LINEAR;
+static Accumulator::Format g_format = Accumulator::FORMAT_FLOAT;
+
+// Extra outputs saved with each PNG: a thumbnail shrunk by this factor
+// (0 for none), the image with 16 bits per sample, and the linear sum.
+static int g_thumbnail_factor;
+static bool g_save_png16;
+static bool g_save_pfm;
+
+// Whether to also save the raw sums, for "prism merge".
+static bool g_save_accumulator;
+
+// Accumulator files to merge, or the file to tone-map.
+static std::vector<std::string> g_input_pathnames;
+
+// Operators that "prism tonemap" saves an image with each of, and its
+// exposure and white point.
+static std::vector<ToneOperator> g_tone_operators;
+static ToneSettings g_tone_settings;
+
+// Directory of reference accumulator files for "prism regress", whether
+// to rewrite them, and how many dB of PSNR the renders may fall under
+// each scene's usual.
+static std::string g_reference_directory = "regress";
+static bool g_update_references;
+static double g_tolerance = 3;
+
+// Accumulator file that "prism converge" renders towards, and how many dB
+// of PSNR it must get within.
+static std::string g_reference_pathname;
+static double g_target_psnr = 35;
+
+// Whether all threads share one accumulator.
+static bool g_shared_image;
+
+// Number of threads to use, or 0 for one per CPU.
 static int g_thread_count;
 
-// How many worker threads are still working.
-static std::atomic_int g_working;
+// Whether to use the thread count and placement that "prism scaling"
+// found fastest on this machine, running it first if it hasn't been.
+static bool g_auto_threads;
+
+// Whether to pin threads to CPUs, and in what order.
+static bool g_pin_threads;
+static Topology::Placement g_placement = Topology::PLACEMENT_CORES;
+
+// CPUs by NUMA node, and the node of each worker when pinned.
+static Topology g_topology;
+static std::vector<int> g_worker_nodes;
+
+// Totals of the batches' trace stats.
+static std::atomic<int64_t> g_bounces;
+static std::atomic<int64_t> g_landed;
+static std::atomic<int64_t> g_deep_bounces;
+static std::atomic<int64_t> g_roulette_drops;
+static std::atomic<int64_t> g_bounce_limit_drops;
+
+// Set by SIGINT and SIGTERM.
+static std::atomic<bool> g_interrupted;
+
+// When we started, and how many microseconds later the first photon was
+// traced (-1 until then), for measuring startup.
+static const std::chrono::steady_clock::time_point g_start_time = std::chrono::steady_clock::now();
+static std::atomic<int64_t> g_first_photon_usec(-1);
 
-// Normalized 2D normal vector to two vertices.
-Vec3 get_2d_normal(Vec3 const &p1, Vec3 const &p2) {
-    Vec3 v = p2 - p1;
+// Whether we've warned that fixed32 images were clipped.
+static std::atomic<bool> g_warned_saturated;
 
-    return Vec3(-v.y(), v.x(), 0).unit();
+// Pixels per tone-mapping task.
+static const int64_t TONE_MAP_GRAIN = 64*1024;
+
+// Microseconds between checks of "prism converge".
+static const int64_t CONVERGE_CHECK_USEC = 250*1000;
+
+// "prism converge" gives up if the PSNR gained less than this many dB
+// while the photons grew by this factor. Noise alone would give about 6
+// dB for every factor of 4, so the rest must be the reference.
+static const double CONVERGE_STALL_FACTOR = 4;
+static const double CONVERGE_STALL_DB = 1;
+
+void handle_signal(int) {
+    g_interrupted = true;
 }
 
-// Return the distance along the ray to hit this side of the prism.
-float intersect_with_prism_side(Ray const &ray,
-        Vec3 const &p1, Vec3 const &p2, Vec3 const &n) {
+// Save the timeline on the way out, whatever we did.
+void save_timeline() {
+    timeline_save(g_timeline_pathname);
+}
 
-    Vec3 p = ray.origin() - p1;
+// Second half of tone mapping: divide the log image by its max, which is
+// the max of "chunk_max", and gamma-correct. Returns the curve, from the
+// linear sum, that this amounts to.
+ToneCurve normalize(Scheduler &scheduler, const Scene &scene, const std::vector<float> &chunk_max,
+        float *image_norm) {
 
-    // See if we're parallel to the side.
-    float denom = ray.direction().dot(n);
-    if (denom == 0) {
-        return -1;
+    float max = 0;
+    for (float m : chunk_max) {
+        max = std::max(max, m);
     }
 
-    // Distance to intersection.
-    float t = -(p.dot(n)) / denom;
+    // Normalize and gamma-correct.
+    scheduler.parallel_for(0, scene.pixel_count(), TONE_MAP_GRAIN, [&](int64_t begin, int64_t end) {
+        TIMED_SCOPE("normalize");
 
-    if (t > MIN_HIT_DIST) {
-        // See if we're within the rectangle.
-        p = ray.point_at(t);
+        float *rgbf = image_norm + begin*3;
+        for (int64_t i = begin; i < end; i++) {
+            // Avoid negative base.
+            rgbf[0] = rgbf[0] > 0 ? 255*pow(rgbf[0]/max, GAMMA) : 0;
+            rgbf[1] = rgbf[1] > 0 ? 255*pow(rgbf[1]/max, GAMMA) : 0;
+            rgbf[2] = rgbf[2] > 0 ? 255*pow(rgbf[2]/max, GAMMA) : 0; 
 
-        // Prism is two high.
-        if (p.z() > 2) {
-            return -1;
+            rgbf += 3;
         }
+    });
 
-        if (fabs(n.x()) > fabs(n.y())) {
-            // Vertical side. Project to Y axis.
-            if (p1.y() < p2.y()) {
-                if (p.y() < p1.y() || p.y() > p2.y()) {
-                    return -1;
-                }
-            } else {
-                if (p.y() < p2.y() || p.y() > p1.y()) {
-                    return -1;
-                }
+    // log(1 + white) is the max. Keep black images black.
+    float white = expm1(max);
+    return ToneCurve(TONE_LOG, 1, white > 0 ? white : 1);
+}
+
+// Warn, once, if an image reached the most that fixed32 holds.
+void warn_if_saturated(bool saturated) {
+    if (saturated && !g_warned_saturated.exchange(true)) {
+        std::cerr << "Some pixels got more light than fixed32 holds and were clipped. " <<
+            "Use --format fixed64.\n";
+    }
+}
+
+// Same, for any of these images.
+void warn_if_saturated(const std::vector<const Accumulator *> &images) {
+    for (const Accumulator *image : images) {
+        warn_if_saturated(image->saturated());
+    }
+}
+
+// Add up the worker images and the fill light, if any, for "photons"
+// photons, take the log, normalize, and gamma-correct into "image_norm"
+// (row-major, 0 to 255). If "image_sum" isn't null, also store the raw
+// sum there. Returns the curve used.
+ToneCurve tone_map(Scheduler &scheduler, const Scene &scene, const std::vector<const Accumulator *> &images,
+        const FillLight *fill, int64_t photons, float *image_norm, float *image_sum) {
+
+    TIMED_SCOPE("tone map");
+
+    warn_if_saturated(images);
+
+    int width = scene.m_width;
+    int height = scene.m_height;
+
+    // Whole rows of tiles per task.
+    int64_t grain_rows = std::max(int64_t(1), (TONE_MAP_GRAIN/width + TILE_SIZE - 1)/TILE_SIZE)*TILE_SIZE;
+
+    // Max of each task's pixels.
+    std::vector<float> chunk_max((height + grain_rows - 1)/grain_rows);
+
+    // Take log of color.
+    scheduler.parallel_for(0, height, grain_rows, [&](int64_t begin, int64_t end) {
+        TIMED_SCOPE("sum and log");
+
+        float *rgbt = image_norm + begin*width*3;
+        int64_t count = (end - begin)*width*3;
+
+        // Add one because log(1) = 0.
+        std::fill(rgbt, rgbt + count, 1.0f);
+
+        // Add all images, converting them to row-major.
+        Accumulator::add_rows_to(images, rgbt, begin, end);
+        if (fill != nullptr) {
+            fill->add_rows_to(rgbt, begin, end, photons);
+        }
+
+        if (image_sum != nullptr) {
+            float *sum = image_sum + begin*width*3;
+            for (int64_t i = 0; i < count; i++) {
+                sum[i] = rgbt[i] - 1;
             }
-        } else {
-            // Horizontal side. Project to X axis.
-            if (p1.x() < p2.x()) {
-                if (p.x() < p1.x() || p.x() > p2.x()) {
-                    return -1;
+        }
+
+        float max = 0;
+        for (int64_t i = 0; i < count; i++) {
+            rgbt[i] = log(rgbt[i]);
+            max = std::max(max, rgbt[i]);
+        }
+        chunk_max[begin/grain_rows] = max;
+    });
+
+    return normalize(scheduler, scene, chunk_max, image_norm);
+}
+
+// Same, from a running sum of tiled images that's already up to date.
+// Tiles that have never had any light are skipped.
+ToneCurve tone_map(Scheduler &scheduler, const Scene &scene, const RunningSum &sum,
+        float *image_norm, float *image_sum) {
+
+    TIMED_SCOPE("tone map");
+
+    warn_if_saturated(sum.saturated());
+
+    int width = scene.m_width;
+    int height = scene.m_height;
+
+    // Whole rows of tiles per task.
+    int64_t grain_rows = std::max(int64_t(1), (TONE_MAP_GRAIN/width + TILE_SIZE - 1)/TILE_SIZE)*TILE_SIZE;
+
+    // Max of each task's pixels.
+    std::vector<float> chunk_max((height + grain_rows - 1)/grain_rows);
+
+    // Take log of color.
+    scheduler.parallel_for(0, height, grain_rows, [&](int64_t begin, int64_t end) {
+        TIMED_SCOPE("log");
+
+        if (image_sum != nullptr) {
+            std::copy(sum.values() + begin*width*3, sum.values() + end*width*3, image_sum + begin*width*3);
+        }
+
+        float max = 0;
+        for (int64_t y = begin; y < end; y++) {
+            const float *src = sum.values() + y*width*3;
+            float *rgbt = image_norm + y*width*3;
+
+            for (int x0 = 0; x0 < width; x0 += TILE_SIZE) {
+                int64_t count = std::min(TILE_SIZE, width - x0)*3;
+
+                if (!sum.is_lit(int(y >> TILE_SHIFT), x0 >> TILE_SHIFT)) {
+                    std::fill(rgbt + x0*3, rgbt + x0*3 + count, 0.0f);
+                    continue;
                 }
-            } else {
-                if (p.x() < p2.x() || p.x() > p1.x()) {
-                    return -1;
+
+                for (int64_t i = x0*3; i < x0*3 + count; i++) {
+                    // Add one because log(1) = 0.
+                    rgbt[i] = log(src[i] + 1);
+                    max = std::max(max, rgbt[i]);
                 }
             }
         }
-    } else {
-        t = -1;
-    }
+        chunk_max[begin/grain_rows] = max;
+    });
 
-    return t;
+    return normalize(scheduler, scene, chunk_max, image_norm);
 }
 
-// Plot a single pixel. For debugging.
-void plot_point(float *image, Vec3 const &p) {
-    Vec3 pi = (p + Vec3(0.5, 0.5, 0))*WIDTH;
+// Sum the workers' images (null for unused ones) into one image per NUMA
+// node, each summed by that node's own workers into memory they touched
+// first, so that tone_map() reads one image per node instead of one per
+// thread and most of the traffic stays on the local memory controller.
+// Without pinned workers on several nodes, or with one shared image,
+// returns the images as-is.
+std::vector<const Accumulator *> reduce_by_node(Scheduler &scheduler, const Scene &scene,
+        const std::vector<const Accumulator *> &worker_images, std::vector<Accumulator *> &node_sums) {
 
-    int x = (int) (pi.x() + 0.5);
-    int y = HEIGHT - 1 - (int) (pi.y() + 0.5);
+    std::vector<const Accumulator *> images;
 
-    // std::cout << x << ", " << y << "\n";
-    if (x >= 0 && y >= 0 && x < WIDTH && y < HEIGHT) {
-        int i = (y*WIDTH + x)*3;
-        image[i + 0] = 1;
-        image[i + 1] = 1;
-        image[i + 2] = 1;
-    }
-}
+    if (g_worker_nodes.empty() || g_topology.node_count() < 2 ||
+            worker_images.size() != g_worker_nodes.size()) {
 
-// Approximate reflection coefficient.
-static float schlick(float cosine, float refraction_index) {
-    float r0 = (1 - refraction_index) / (1 + refraction_index);
-    r0 *= r0;
-    return r0 + (1 - r0)*pow(1 - cosine, 5);
-}
+        for (const Accumulator *image : worker_images) {
+            if (image != nullptr) {
+                images.push_back(image);
+            }
+        }
 
-// Get new ray from an intersection with glass.
-void hit_glass(Ray const &ray_in, Vec3 const &p, Vec3 const &n,
-        float refraction_index, Ray &ray_out) {
-
-    // Our ray's direction, normalized.
-    Vec3 dir = ray_in.direction().unit();
-
-    // We don't know whether we're inside the material or outside.
-    // Our hit normal will always point outward. We want a normal
-    // that points in the direction we came from.
-    Vec3 normal;
-    float ni_over_nt;
-    float cosine;
-    if (dir.dot(n) > 0) {
-        // We're inside. Reverse normal.
-        normal = -n;
-        ni_over_nt = refraction_index;
-        cosine = refraction_index*dir.dot(n);
-    } else {
-        // We're outside. Use normal as-is.
-        normal = n;
-        ni_over_nt = 1/refraction_index;
-        cosine = -dir.dot(n);
+        return images;
     }
 
-    Vec3 refracted;
-    if (refract(dir, normal, ni_over_nt, refracted)) {
-        // We can refract. Figure out if we should.
-        float reflection_probability = schlick(cosine, refraction_index);
+    int node_count = g_topology.node_count();
+    node_sums.resize(node_count, nullptr);
+
+    TaskGroup group;
+    for (int node = 0; node < node_count; node++) {
+        std::vector<int> workers;
+        std::vector<const Accumulator *> node_images;
+        for (size_t worker = 0; worker < worker_images.size(); worker++) {
+            if (g_worker_nodes[worker] == node) {
+                workers.push_back(worker);
+                if (worker_images[worker] != nullptr) {
+                    node_images.push_back(worker_images[worker]);
+                }
+            }
+        }
+        if (node_images.empty()) {
+            continue;
+        }
 
-        if (my_rand() < reflection_probability) {
-            Vec3 reflected = reflect(dir, n);
-            ray_out = Ray(p, reflected, ray_in.wavelength());
-        } else {
-            ray_out = Ray(p, refracted, ray_in.wavelength());
+        // Pages of the new buffer get placed on the node of whichever
+        // worker first writes them, which will be one of this node's.
+        if (node_sums[node] == nullptr) {
+            node_sums[node] = new Accumulator(scene.m_width, scene.m_height, g_layout, g_format);
         }
-    } else {
-        // Can't refract. Only reflect.
-        Vec3 reflected = reflect(dir, n);
-        ray_out = Ray(p, reflected, ray_in.wavelength());
+        Accumulator *node_sum = node_sums[node];
+        node_sum->clear_saturated();
+
+        // Same layout, so sum value by value.
+        int64_t value_count = node_sum->value_count();
+        int chunk = 0;
+        for (int64_t begin = 0; begin < value_count; begin += TONE_MAP_GRAIN*3, chunk++) {
+            int64_t end = std::min(begin + TONE_MAP_GRAIN*3, value_count);
+
+            scheduler.submit_to(workers[chunk % workers.size()], [node_sum, node_images, begin, end] {
+                TIMED_SCOPE("reduce");
+                node_sum->set_sum(node_images, begin, end);
+            }, &group);
+        }
+
+        images.push_back(node_sums[node]);
     }
+    scheduler.wait(group);
+
+    return images;
 }
 
-// Render into "image" with the specified random seed.
-void render_image(float *image, int seed) {
-    // Initialize the seed for our thread.
-    init_rand(seed);
-
-    // 2D vertices of prism, clockwise from lower-left.
-    Vec3 p0(-PRISM_WIDTH/2, 0, 0);
-    Vec3 p1(0, PRISM_WIDTH*sqrt(3)/2, 0);
-    Vec3 p2(PRISM_WIDTH/2, 0, 0);
-
-    // Center prism at 0,0,0.
-    Vec3 offset(0, -p1.y()*0.4, 0);
-    p0 += offset;
-    p1 += offset;
-    p2 += offset;
-
-    // 2D normals of prism, clockwise from left face.
-    Vec3 n01 = get_2d_normal(p0, p1);
-    Vec3 n12 = get_2d_normal(p1, p2);
-    Vec3 n20 = get_2d_normal(p2, p0);
-
-    // Draw vertices of prism, for debugging.
-    /// plot_point(image, p0);
-    /// plot_point(image, p1);
-    /// plot_point(image, p2);
-
-    while (!g_quit) {
-        // Random ray from light source, through slit.
-        Vec3 ray_origin(-10, -3.2, 1);
-        Vec3 ray_target(-0.6, my_rand()*0.002 - 0.05, my_rand());
-        int wavelength = (int) (380 + (700 - 380)*my_rand());
-        // ray_target = Vec3(-0.6, (wavelength - 380)/(700 - 380.0) - 0.5, my_rand());
-
-        /*
-        float xxx = my_rand()*2*M_PI;
-        ray_origin = Vec3(3*cos(xxx), 3*sin(xxx), 1);
-        ray_target = Vec3(0, 0, my_rand());
-
-        float yyy = ((p0 + p1 + p2)/3).y();
-        ray_origin = Vec3(30*cos(xxx), 30*sin(xxx) + yyy, 1);
-        ray_target = Vec3(0, yyy, my_rand());
-
-        float xxx2 = my_rand()*2*M_PI;
-        ray_target = Vec3(.5*cos(xxx2), .5*sin(xxx2) + yyy, my_rand());
-        */
-
-        ray_origin += offset;
-        ray_target += offset;
-
-        // Occasionally send some light from above, to highlight the prism itself.
-        if (my_rand() < 0.10) {
-            Vec3 p_avg = (p0 + p1 + p2)/3;
-            ray_origin = p_avg + Vec3((my_rand() - 0.5)*0.1, (my_rand() - 0.5)*0.1, 10);
-            ray_target = p_avg + Vec3(my_rand() - 0.5, my_rand() - 0.5, 0);
-        }
-
-        Ray ray(ray_origin, (ray_target - ray_origin).unit(), wavelength);
-
-        bool done_with_ray = false;
-        while (!done_with_ray) {
-            // Intersect distance.
-            float best_t = std::numeric_limits<float>::max();
-            Vec3 best_p;
-            Vec3 best_n;
-            int best_obj = -1; // 0-2 = prism, 3 = floor.
-
-            // Intersect with prism.
-            float t = intersect_with_prism_side(ray, p0, p1, n01);
-            if (t > MIN_HIT_DIST && t < best_t) {
-                Vec3 p = ray.point_at(t);
-                if (p.z() > 0) {
-                    best_t = t;
-                    best_p = p;
-                    best_n = n01;
-                    best_obj = 0;
-                }
-            }
+// Save the normalized image to disk, along with the thumbnail, 16-bit
+// PNG, and PFM of the linear sum "image_sum" (if not null) that were asked
+// for. "curve" is what mapped "image_sum" to "image". The thumbnail
+// averages the linear sum and maps that, since averaging the mapped values
+// darkens thin bright lines; without the sum there's no thumbnail. All are
+// converted in one pass over the rows, and encoded by scheduler tasks, so
+// the images can be reused as soon as this returns.
+void save_image(Scheduler &scheduler, const Scene &scene, const float *image, const float *image_sum,
+        const ToneCurve &curve, const std::string &pathname) {
+
+    int width = scene.m_width;
+    int height = scene.m_height;
+    int64_t pixel_count = scene.pixel_count();
+
+    // "out4-001.png" becomes "out4-001-thumb.png" and so on.
+    std::string stem = pathname.substr(0, pathname.rfind('.'));
+
+    int factor = image_sum != nullptr ? g_thumbnail_factor : 0;
+    int thumb_width = factor > 0 ? (width + factor - 1)/factor : 0;
+    int thumb_height = factor > 0 ? (height + factor - 1)/factor : 0;
+
+    unsigned char *rgb_image = new unsigned char[pixel_count*3];
+    unsigned char *thumb_image = factor > 0 ? new unsigned char[thumb_width*thumb_height*3] : nullptr;
+    uint16_t *rgb16_image = g_save_png16 ? new uint16_t[pixel_count*3] : nullptr;
+    float *linear_image = g_save_pfm && image_sum != nullptr ? new float[pixel_count*3] : nullptr;
+
+    // Whole rows of thumbnail pixels per task.
+    int64_t grain_rows = std::max(int64_t(1), TONE_MAP_GRAIN/width);
+    if (factor > 0) {
+        grain_rows = (grain_rows + factor - 1)/factor*factor;
+    }
 
-            t = intersect_with_prism_side(ray, p1, p2, n12);
-            if (t > MIN_HIT_DIST && t < best_t) {
-                Vec3 p = ray.point_at(t);
-                if (p.z() > 0) {
-                    best_t = t;
-                    best_p = p;
-                    best_n = n12;
-                    best_obj = 1;
-                }
+    scheduler.parallel_for(0, height, grain_rows, [&](int64_t begin, int64_t end) {
+        TIMED_SCOPE("convert");
+
+        // Convert from float to 8-bit RGB, and the others.
+        const float *rgbf = image + begin*width*3;
+        unsigned char *rgb = rgb_image + begin*width*3;
+        for (int64_t i = 0; i < (end - begin)*width*3; i++) {
+            rgb[i] = (unsigned char) rgbf[i];
+        }
+        if (rgb16_image != nullptr) {
+            uint16_t *rgb16 = rgb16_image + begin*width*3;
+            for (int64_t i = 0; i < (end - begin)*width*3; i++) {
+                rgb16[i] = uint16_t(std::min(rgbf[i]*257 + 0.5f, 65535.0f));
             }
+        }
+        if (linear_image != nullptr) {
+            // Bottom row first.
+            for (int64_t y = begin; y < end; y++) {
+                std::copy(image_sum + y*width*3, image_sum + (y + 1)*width*3,
+                        linear_image + (height - 1 - y)*width*3);
+            }
+        }
 
-            t = intersect_with_prism_side(ray, p2, p0, n20);
-            if (t > MIN_HIT_DIST && t < best_t) {
-                Vec3 p = ray.point_at(t);
-                if (p.z() > 0) {
-                    best_t = t;
-                    best_p = p;
-                    best_n = n20;
-                    best_obj = 2;
+        // Box-filter the same rows while they're in the cache.
+        if (factor > 0) {
+            for (int64_t ty = begin/factor; ty*factor < end; ty++) {
+                int y_end = std::min(int((ty + 1)*factor), height);
+
+                for (int tx = 0; tx < thumb_width; tx++) {
+                    int x_end = std::min((tx + 1)*factor, width);
+                    float sum[3] = { 0, 0, 0 };
+
+                    for (int y = int(ty*factor); y < y_end; y++) {
+                        const float *p = image_sum + (int64_t(y)*width + tx*factor)*3;
+                        for (int x = tx*factor; x < x_end; x++) {
+                            sum[0] += p[0];
+                            sum[1] += p[1];
+                            sum[2] += p[2];
+                            p += 3;
+                        }
+                    }
+
+                    float scale = 1.0f/((y_end - int(ty*factor))*(x_end - tx*factor));
+                    unsigned char *t = thumb_image + (ty*thumb_width + tx)*3;
+                    t[0] = (unsigned char) curve.map(sum[0]*scale);
+                    t[1] = (unsigned char) curve.map(sum[1]*scale);
+                    t[2] = (unsigned char) curve.map(sum[2]*scale);
                 }
             }
+        }
+    });
 
-            // Intersect with ground plane.
-            float dz = ray.m_direction.z();
-            if (dz != 0) {
-                t = -ray.m_origin.z()/dz;
+    // Write images.
+    scheduler.submit([rgb_image, width, height, pathname] {
+        TIMED_SCOPE("encode PNG");
 
-                if (t > MIN_HIT_DIST && t < best_t) {
-                    Vec3 p = ray.point_at(t);
+        std::cout << "Saving to " << pathname << "\n";
+        int success = stbi_write_png(pathname.c_str(), width, height, 3, rgb_image, width*3);
+        if (!success) {
+            std::cerr << "Cannot write output image.\n";
+        }
 
-                    best_t = t;
-                    best_p = p;
-                    best_n = Vec3(0, 0, 1);
-                    best_obj = 3;
-                }
+        delete[] rgb_image;
+    });
+    if (thumb_image != nullptr) {
+        std::string thumb_pathname = stem + "-thumb.png";
+        scheduler.submit([thumb_image, thumb_width, thumb_height, thumb_pathname] {
+            TIMED_SCOPE("encode thumbnail");
+
+            if (!stbi_write_png(thumb_pathname.c_str(), thumb_width, thumb_height, 3,
+                        thumb_image, thumb_width*3)) {
+
+                std::cerr << "Cannot write " << thumb_pathname << "\n";
             }
 
-            switch (best_obj) {
-                case -1:
-                    // Didn't intersect anything.
-                    done_with_ray = true;
-                    break;
-
-                case 0:
-                case 1:
-                case 2: {
-                            // Compute index of refraction for wavelength.
-                            // https://en.wikipedia.org/wiki/Cauchy%27s_equation
-                            float B = 1.5046;
-                            float C = 0.00420;
-
-                            // Widen rainbow, renormalize B.
-                            float new_C = C*10;
-                            B = B + C/(.540*.540) - new_C/(.540*.540);
-                            C = new_C;
-
-                            float wl_um = ray.wavelength()/1000.0;
-                            float refraction_index = B + C/(wl_um*wl_um);
-
-                            Ray ray_out;
-                            hit_glass(ray, best_p, best_n, refraction_index, ray_out);
-                            ray = ray_out;
-                            /// std::cout << ray << "\n";
-                            break;
-                        }
+            delete[] thumb_image;
+        });
+    }
+    if (rgb16_image != nullptr) {
+        std::string png16_pathname = stem + "-16.png";
+        scheduler.submit([rgb16_image, width, height, png16_pathname] {
+            TIMED_SCOPE("encode 16-bit PNG");
+
+            write_png16(png16_pathname, width, height, rgb16_image);
+            delete[] rgb16_image;
+        });
+    }
+    if (linear_image != nullptr) {
+        std::string pfm_pathname = stem + ".pfm";
+        scheduler.submit([linear_image, width, height, pfm_pathname] {
+            TIMED_SCOPE("write PFM");
+
+            write_pfm(pfm_pathname, width, height, linear_image);
+            delete[] linear_image;
+        });
+    }
+}
 
-                case 3: {
-                            // Landed on paper, leave a spot.
-                            Vec3 p = (best_p*ZOOM + Vec3(0.5, HEIGHT/2.0/WIDTH, 0))*WIDTH;
+// Buffer for the linear sum of an image that's about to be saved, or
+// null if it won't be used.
+float *new_linear_image(const Scene &scene) {
+    return g_save_pfm || g_thumbnail_factor > 0 ? new float[scene.pixel_count()*3] : nullptr;
+}
 
-                            int x = (int) (p.x() + 0.5);
-                            int y = HEIGHT - 1 - (int) (p.y() + 0.5);
+// Pathname for an output file, e.g. "out4-001.png".
+std::string output_pathname(int counter, int digits, const char *extension = ".png") {
+    std::ostringstream pathname;
+    pathname << g_output_prefix << "-" << std::setfill('0') <<
+        std::setw(digits) << counter << extension;
 
-                            if (x >= 0 && y >= 0 && x < WIDTH && y < HEIGHT) {
-                                Vec3 rgb = wavelength2rgb(ray.wavelength());
+    return pathname.str();
+}
 
-                                int i = (y*WIDTH + x)*3;
-                                image[i + 0] += rgb.r()*0.001;
-                                image[i + 1] += rgb.g()*0.001;
-                                image[i + 2] += rgb.b()*0.001;
-                            }
-                            done_with_ray = true;
-                            break;
-                        }
-            }
-        }
+// Save the sum of the images as an accumulator file, if asked to.
+void save_accumulator(const Scene &scene, const std::vector<const Accumulator *> &images,
+        int64_t photons, const std::string &pathname) {
+
+    if (g_save_accumulator && !images.empty()) {
+        std::cout << "Saving to " << pathname << "\n";
+        AccumulatorFile::sum_of(images, photons, scene.m_fill_light).save(pathname);
+    }
+}
+
+void start_lanes(Scheduler *scheduler, FrameQueue *queue, int count);
+
+// Tone-map and save a finished frame of a sequence, then recycle its slot.
+void finish_frame(Scheduler *scheduler, FrameQueue *queue, const PhotonBatch &batch) {
+    TIMED_SCOPE("finish frame");
+
+    const Scene &scene = queue->scene(batch.m_slot);
+    float *image_norm = queue->scratch(batch.m_slot);
+
+    std::vector<const Accumulator *> images = reduce_by_node(*scheduler, scene,
+            queue->worker_images(batch.m_slot), queue->node_sums(batch.m_slot));
+    std::unique_ptr<FillLight> fill;
+    if (g_fill_pass > 0) {
+        fill.reset(new FillLight(*scheduler, scene, g_fill_pass, g_seed));
     }
+    float *image_sum = new_linear_image(scene);
+    ToneCurve curve = tone_map(*scheduler, scene, images, fill.get(), g_photons, image_norm, image_sum);
+    save_image(*scheduler, scene, image_norm, image_sum, curve, output_pathname(batch.m_frame, 4));
+    delete[] image_sum;
+    save_accumulator(scene, images, g_photons, output_pathname(batch.m_frame, 4, ".acc"));
+
+    // Lanes that were waiting for this slot can go again.
+    start_lanes(scheduler, queue, queue->release_slot(batch.m_slot));
+}
 
-    // We're no longer working.
-    g_working--;
+// Add a batch's stats to the totals.
+void add_trace_stats(const TraceStats &stats) {
+    g_bounces += stats.m_bounces;
+    g_landed += stats.m_landed;
+    g_deep_bounces += stats.m_deep_bounces;
+    g_roulette_drops += stats.m_roulette_drops;
+    g_bounce_limit_drops += stats.m_bounce_limit_drops;
 }
 
-// Same normalized image to disk.
-void save_image(float *image, int file_counter) {
-    // Convert from RGBA to RGB.
-    unsigned char *rgb_image = new unsigned char[PIXEL_COUNT*3];
-    unsigned char *rgb = rgb_image;
-    float *rgbf = image;
-    for (int i = 0; i < PIXEL_COUNT; i++) {
-        rgb[0] = (unsigned char) rgbf[0];
-        rgb[1] = (unsigned char) rgbf[1];
-        rgb[2] = (unsigned char) rgbf[2];
+// Trace one batch, then queue ourselves to do the next.
+void run_lane(Scheduler *scheduler, FrameQueue *queue) {
+    PhotonBatch batch;
 
-        rgbf += 3;
-        rgb += 3;
+    // If we have to wait for a slot, release_slot() will restart us.
+    if (queue->next_batch(batch) != FrameQueue::BATCH_READY) {
+        return;
+    }
+
+    Accumulator *image = queue->image(batch, Scheduler::worker_index());
+    if (g_first_photon_usec < 0) {
+        int64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - g_start_time).count();
+        int64_t none = -1;
+        g_first_photon_usec.compare_exchange_strong(none, usec);
+    }
+    TraceStats stats = TraceStats();
+    g_tracer(queue->scene(batch.m_slot), *image, batch.m_photons, batch.m_seed, stats);
+    scheduler->add_progress(batch.m_photons);
+    add_trace_stats(stats);
+
+    // In a sequence, whoever finishes a frame saves it while the
+    // others move on to the next one.
+    if (queue->finish_batch(batch) && g_frame_count > 0) {
+        finish_frame(scheduler, queue, batch);
     }
 
-    // Write image.
-    std::ostringstream final_pathname;
-    final_pathname << "out4" << "-" << std::setfill('0') <<
-        std::setw(3) << file_counter << ".png";
+    scheduler->submit([scheduler, queue] { run_lane(scheduler, queue); });
+}
+
+// Start "count" chains of photon batches.
+void start_lanes(Scheduler *scheduler, FrameQueue *queue, int count) {
+    for (int i = 0; i < count; i++) {
+        scheduler->submit([scheduler, queue] { run_lane(scheduler, queue); });
+    }
+}
+
+// Sleep for up to "usec" microseconds, waking early if the work is done
+// or we're interrupted.
+void sleep_while_working(Scheduler &scheduler, int64_t usec) {
+    TIMED_SCOPE("sleep");
 
-    std::cout << "Saving to " << final_pathname.str() << "\n";
-    int success = stbi_write_png(final_pathname.str().c_str(),
-            WIDTH, HEIGHT, 3, rgb_image, WIDTH*3);
-    if (!success) {
-        std::cerr << "Cannot write output image.\n";
+    while (usec > 0 && scheduler.unfinished() > 0 && !g_interrupted) {
+        TIMELINE_COUNTER("photons", scheduler.progress());
+        int64_t slice = std::min(usec, int64_t(100*1000));
+        usleep(slice);
+        usec -= slice;
     }
 }
 
+// Print what happened to the photons.
+void print_trace_stats(int64_t photons) {
+    if (photons > 0) {
+        std::cout << "Traced " << photons << " photons, " <<
+            std::setprecision(3) << double(g_bounces)/photons << " bounces per photon, " <<
+            std::setprecision(3) << 100.0*g_landed/photons << "% landed on the paper.\n";
+
+        // How much of the work went into deep paths.
+        if (g_bounces > 0) {
+            std::cout << std::setprecision(3) << 100.0*g_deep_bounces/g_bounces <<
+                "% of bounces came after bounce " << g_scene.m_roulette_bounces << ", " <<
+                g_roulette_drops << " rays dropped by Russian roulette, " <<
+                g_bounce_limit_drops << " at the bounce limit.\n";
+        }
+    }
+    if (g_first_photon_usec >= 0) {
+        std::cout << "First photon traced " << std::setprecision(3) << g_first_photon_usec*1e-3 <<
+            " ms after starting.\n";
+    }
+}
+
+// CPUs to pin workers to, or empty if not pinning.
+std::vector<int> worker_cpus() {
+    return g_pin_threads ? g_topology.worker_cpus(g_thread_count, g_placement) : std::vector<int>();
+}
+
 // Render a single frame.
 void render_frame() {
+    const Scene &scene = g_scene;
+    int64_t pixel_count = scene.pixel_count();
+
+    float *image_norm = new float[pixel_count*3];
+    float *image_linear = new_linear_image(scene);
 #ifdef DISPLAY
     // For display.
-    float *image_norm = new float[PIXEL_COUNT*3];
-    uint32_t *image32 = new uint32_t[PIXEL_COUNT];
+    uint32_t *image32 = g_update_display ? new uint32_t[pixel_count] : nullptr;
 #endif
 
-    g_quit = false;
+    // For external viewers.
+    SharedFrame shared_frame;
+    if (!g_shm_name.empty()) {
+        if (shared_frame.open(g_shm_name, scene.m_width, scene.m_height)) {
+            std::cout << "Publishing frames to shared memory " << g_shm_name << "\n";
+        }
+    }
 
-    g_thread_count = std::thread::hardware_concurrency();
-    std::cout << "Using " << g_thread_count << " threads.\n";
+    // Generate the image on all cores.
+    Scheduler scheduler(g_thread_count, worker_cpus());
+    FrameQueue queue(scene, g_sweeps, 1, g_photons, g_thread_count, g_seed,
+            g_layout, g_format, g_shared_image);
+    start_lanes(&scheduler, &queue, g_thread_count);
 
-    g_working = g_thread_count;
+    // Photons are traced while the fill pass renders, rather than after.
+    std::unique_ptr<FillLight> fill;
+    if (g_fill_pass > 0) {
+        fill.reset(new FillLight(scheduler, scene, g_fill_pass, g_seed));
+    }
 
-    // Generate the image on multiple threads.
-    std::vector<float *> images;
-    std::vector<std::thread *> thread;
-    for (int t = 0; t < g_thread_count; t++) {
-        float *image = new float[PIXEL_COUNT*3];
-        images.push_back(image);
-        thread.push_back(new std::thread(render_image, image, random()));
+    // While rendering, only re-add the tiles that changed, unless the
+    // fill pass is on, since it changes every pixel as photons come in.
+    std::unique_ptr<RunningSum> running_sum;
+    if (g_layout == Accumulator::LAYOUT_TILED && !fill) {
+        running_sum.reset(new RunningSum(scene.m_width, scene.m_height));
     }
 
-#ifdef DISPLAY
-    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point render_start_time = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point start_time = render_start_time;
     int file_counter = 1;
-
-    while (g_working > 0) {
-        // Take log of color.
-        float *rgbt = image_norm;
-        float max = 0;
-        for (int i = 0; i < PIXEL_COUNT; i++) {
-            // Add one because log(1) = 0.
-            rgbt[0] = 1;
-            rgbt[1] = 1;
-            rgbt[2] = 1;
-
-            // Add all images.
-            for (int j = 0; j < g_thread_count; j++) {
-                rgbt[0] += images[j][i*3 + 0];
-                rgbt[1] += images[j][i*3 + 1];
-                rgbt[2] += images[j][i*3 + 2];
+    bool quit = false;
+
+    while (scheduler.unfinished() > 0) {
+        // Raw sum goes straight into the shared memory segment, if any, where
+        // it's also saved from.
+        float *image_sum = shared_frame.is_open() ? shared_frame.back_accumulator() : image_linear;
+        ToneCurve curve;
+
+        if (running_sum) {
+            // Only changed tiles are read, so there's no point in summing
+            // by node first.
+            std::vector<const Accumulator *> images;
+            for (const Accumulator *image : queue.worker_images(0)) {
+                if (image != nullptr) {
+                    images.push_back(image);
+                }
             }
-
-            rgbt[0] = log(rgbt[0]);
-            rgbt[1] = log(rgbt[1]);
-            rgbt[2] = log(rgbt[2]);
-
-            max = std::max(std::max(std::max(max, rgbt[0]), rgbt[1]), rgbt[2]);
-
-            rgbt += 3;
+            running_sum->update(scheduler, images);
+            curve = tone_map(scheduler, scene, *running_sum, image_norm, image_sum);
+        } else {
+            std::vector<const Accumulator *> images = reduce_by_node(scheduler, scene,
+                    queue.worker_images(0), queue.node_sums(0));
+            curve = tone_map(scheduler, scene, images, fill.get(), scheduler.progress(), image_norm, image_sum);
         }
 
-        // Convert from float to 32-bit integer.
-        float *rgbf = image_norm;
-        for (int i = 0; i < PIXEL_COUNT; i++) {
-            // Avoid negative base.
-            rgbf[0] = rgbf[0] > 0 ? 255*pow(rgbf[0]/max, GAMMA) : 0;
-            rgbf[1] = rgbf[1] > 0 ? 255*pow(rgbf[1]/max, GAMMA) : 0;
-            rgbf[2] = rgbf[2] > 0 ? 255*pow(rgbf[2]/max, GAMMA) : 0; 
+        // Convert from float to 32-bit integer, for the viewer and the
+        // shared memory segment.
+        uint32_t *pixels32 = nullptr;
+#ifdef DISPLAY
+        pixels32 = image32;
+#endif
+        if (shared_frame.is_open()) {
+            pixels32 = shared_frame.back_pixels();
+        }
+        if (pixels32 != nullptr) {
+            float *rgbf = image_norm;
+            for (int64_t i = 0; i < pixel_count; i++) {
+                pixels32[i] = (uint32_t(rgbf[0]) << 16) | (uint32_t(rgbf[1]) << 8) | uint32_t(rgbf[2]);
 
-            image32[i] = MFB_RGB(
-                    (unsigned char) rgbf[0],
-                    (unsigned char) rgbf[1],
-                    (unsigned char) rgbf[2]);
+                rgbf += 3;
+            }
+        }
 
-            rgbf += 3;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (shared_frame.is_open()) {
+            std::chrono::duration<double> elapsed = now - render_start_time;
+            shared_frame.publish(elapsed.count());
         }
 
-#ifdef UPDATE_DISPLAY
-        int state = mfb_update(image32);
-#else
         int state = 0;
+#ifdef DISPLAY
+        if (g_update_display) {
+            // The viewer only uploads the tiles that changed.
+            state = mfb_update(pixels32);
+        }
 #endif
-        if (state < 0) {
-            // Tell workers to quit.
-            g_quit = true;
+        if (state < 0 || g_interrupted) {
+            // Tell workers to quit. They finish the batch they're on.
+            queue.quit();
+            quit = true;
+            scheduler.wait_idle();
         } else {
-#ifdef UPDATE_DISPLAY
-            usleep(300*1000);
-#else
-            usleep(300*1000*60);
-#endif
+            bool interactive = g_update_display || shared_frame.is_open();
+            sleep_while_working(scheduler, interactive ? 300*1000 : 300*1000*60);
 
             // Periodically save an image.
-            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            now = std::chrono::steady_clock::now();
             std::chrono::steady_clock::duration time_span = now - start_time;
             double seconds = double(time_span.count())*std::chrono::steady_clock::period::num/
                 std::chrono::steady_clock::period::den;
-            if (seconds > 60) {
-                save_image(image_norm, file_counter++);
+            if (g_png_interval > 0 && seconds > g_png_interval && scheduler.unfinished() > 0) {
+                std::cout << scheduler.progress() << " photons\n";
+                save_image(scheduler, scene, image_norm, image_sum, curve, output_pathname(file_counter++, 3));
                 start_time = std::chrono::steady_clock::now();
             }
         }
     }
+
+    // Save the finished image if we had a photon budget.
+    if (!quit && g_photons >= 0) {
+        std::vector<const Accumulator *> images = reduce_by_node(scheduler, scene,
+                queue.worker_images(0), queue.node_sums(0));
+        ToneCurve curve = tone_map(scheduler, scene, images, fill.get(), g_photons, image_norm, image_linear);
+        save_image(scheduler, scene, image_norm, image_linear, curve, output_pathname(file_counter, 3));
+        save_accumulator(scene, images, g_photons, output_pathname(file_counter, 3, ".acc"));
+        scheduler.wait_idle();
+    }
+    print_trace_stats(scheduler.progress());
+    if (g_perf_counters) {
+        print_perf_counters();
+    }
+
+    delete[] image_norm;
+    delete[] image_linear;
+#ifdef DISPLAY
+    delete[] image32;
 #endif
+}
 
-    // Wait for worker threads to quit.
-    for (int t = 0; t < g_thread_count; t++) {
-        thread[t]->join();
-        delete thread[t];
-        thread[t] = nullptr;
+// Render a sequence of frames, each to its own file.
+void render_sequence() {
+    std::cout << "Rendering " << g_frame_count << " frames of " << g_photons << " photons.\n";
 
-        delete images[t];
-        images[t] = nullptr;
+    Scheduler scheduler(g_thread_count, worker_cpus());
+    FrameQueue queue(g_scene, g_sweeps, g_frame_count, g_photons, g_thread_count, g_seed,
+            g_layout, g_format, g_shared_image);
+    start_lanes(&scheduler, &queue, g_thread_count);
+
+    while (scheduler.unfinished() > 0) {
+        sleep_while_working(scheduler, 1000*1000);
+        if (g_interrupted) {
+            queue.quit();
+            break;
+        }
     }
+
+    scheduler.wait_idle();
+    print_trace_stats(scheduler.progress());
+    if (g_perf_counters) {
+        print_perf_counters();
+    }
+}
+
+// Render a single frame with the photon map, a pass at a time.
+void render_photon_map() {
+    const Scene &scene = g_scene;
+    int64_t pixel_count = scene.pixel_count();
+
+    Scheduler scheduler(g_thread_count, worker_cpus());
+    HitTraceFunction tracer = hit_tracer_for(scene);
+    PhotonMap photon_map(scene.m_width, scene.m_height, g_photon_radius);
+    std::unique_ptr<FillLight> fill;
+    if (g_fill_pass > 0) {
+        fill.reset(new FillLight(scheduler, scene, g_fill_pass, g_seed));
+    }
+
+    // Each worker's hits for the pass.
+    std::vector<std::vector<PhotonHit>> hits(g_thread_count);
+
+    Accumulator image(scene.m_width, scene.m_height, Accumulator::LAYOUT_LINEAR);
+    std::vector<const Accumulator *> images(1, &image);
+    float *image_norm = new float[pixel_count*3];
+    float *image_linear = new_linear_image(scene);
+
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    int file_counter = 1;
+    int64_t photons = 0;
+
+    for (int pass = 0; !g_interrupted && (g_photons < 0 || photons < g_photons); pass++) {
+        int64_t pass_photons = g_photons < 0 ? PHOTONS_PER_PASS : std::min(PHOTONS_PER_PASS, g_photons - photons);
+
+        for (std::vector<PhotonHit> &list : hits) {
+            list.clear();
+        }
+        scheduler.parallel_for(0, pass_photons, PHOTONS_PER_BATCH, [&](int64_t begin, int64_t end) {
+            TraceStats stats = TraceStats();
+            uint64_t seed = (g_seed*1000003 + pass)*1000003 + begin/PHOTONS_PER_BATCH;
+            tracer(scene, hits[Scheduler::worker_index()], end - begin, seed, stats);
+            scheduler.add_progress(end - begin);
+            add_trace_stats(stats);
+        });
+        photon_map.add_pass(scheduler, hits);
+        photons += pass_photons;
+
+        // Periodically save an image.
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+        if (g_png_interval > 0 && elapsed.count() > g_png_interval) {
+            std::cout << photons << " photons\n";
+            photon_map.estimate(scheduler, image);
+            ToneCurve curve = tone_map(scheduler, scene, images, fill.get(), photons, image_norm, image_linear);
+            save_image(scheduler, scene, image_norm, image_linear, curve, output_pathname(file_counter++, 3));
+            start_time = std::chrono::steady_clock::now();
+        }
+    }
+
+    if (!g_interrupted && g_photons >= 0) {
+        photon_map.estimate(scheduler, image);
+        ToneCurve curve = tone_map(scheduler, scene, images, fill.get(), photons, image_norm, image_linear);
+        save_image(scheduler, scene, image_norm, image_linear, curve, output_pathname(file_counter, 3));
+        save_accumulator(scene, images, photons, output_pathname(file_counter, 3, ".acc"));
+    }
+    scheduler.wait_idle();
+    print_trace_stats(scheduler.progress());
+
+    delete[] image_norm;
+    delete[] image_linear;
+}
+
+// Render the average image of "g_photons" photons without randomness,
+// and save it and its accumulator file, for checking the photon renders.
+int render_reference() {
+    const Scene &scene = g_scene;
+
+    if (scene.m_light != Scene::LIGHT_SLIT) {
+        std::cerr << "Only the slit light can be rendered without photons.\n";
+        return 1;
+    }
+    if (g_photons <= 0) {
+        std::cerr << "Need a positive --photons count.\n";
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    Scheduler scheduler(g_thread_count, worker_cpus());
+    std::vector<Accumulator *> images;
+    for (int i = 0; i < g_thread_count; i++) {
+        images.push_back(new Accumulator(scene.m_width, scene.m_height, Accumulator::LAYOUT_LINEAR));
+    }
+    render_beams(scheduler, scene, g_photons, images);
+
+    // The fill light, as the photons or the fill pass would have it.
+    std::unique_ptr<FillLight> fill;
+    if (scene.m_fill_light || g_fill_pass > 0) {
+        fill.reset(new FillLight(scheduler, scene, scene.m_fill_light ? 1 : g_fill_pass, g_seed));
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    std::cout << "Rendered in " << std::setprecision(3) << elapsed.count() << " seconds.\n";
+
+    std::vector<const Accumulator *> sum_images(images.begin(), images.end());
+    float *image_norm = new float[scene.pixel_count()*3];
+    float *image_linear = new_linear_image(scene);
+    ToneCurve curve = tone_map(scheduler, scene, sum_images, fill.get(), g_photons, image_norm, image_linear);
+    save_image(scheduler, scene, image_norm, image_linear, curve, output_pathname(1, 3));
+
+    // Always saved, since it's what the reference is for. Like a photon
+    // render's, it has the fill light if the photons would have traced it,
+    // and not if it's left off or left to --fill-pass.
+    std::string pathname = output_pathname(1, 3, ".acc");
+    std::cout << "Saving to " << pathname << "\n";
+    AccumulatorFile file = AccumulatorFile::sum_of(sum_images, g_photons, scene.m_fill_light);
+    if (scene.m_fill_light) {
+        fill->add_rows_to(file.m_float_values.data(), 0, scene.m_height, g_photons);
+    }
+    bool saved = file.save(pathname);
+
+    scheduler.wait_idle();
+    delete[] image_norm;
+    delete[] image_linear;
+    for (Accumulator *image : images) {
+        delete image;
+    }
+
+    return saved ? 0 : 1;
+}
+
+// Seconds of CPU time the process has used, across all threads.
+double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec*1e-6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec*1e-6;
+}
+
+// PSNR in dB between two tone-mapped images, or infinity if they're the same.
+double tone_mapped_psnr(Scheduler &scheduler, const Scene &scene, const float *image, const float *reference) {
+    int64_t value_count = scene.pixel_count()*3;
+    std::vector<double> chunk_error((value_count + TONE_MAP_GRAIN - 1)/TONE_MAP_GRAIN);
+
+    scheduler.parallel_for(0, value_count, TONE_MAP_GRAIN, [&](int64_t begin, int64_t end) {
+        double error = 0;
+        for (int64_t i = begin; i < end; i++) {
+            double diff = image[i] - reference[i];
+            error += diff*diff;
+        }
+        chunk_error[begin/TONE_MAP_GRAIN] = error;
+    });
+
+    double error = 0;
+    for (double e : chunk_error) {
+        error += e;
+    }
+    double mse = error/value_count;
+
+    return mse > 0 ? 10*log10(255*255/mse) : INFINITY;
+}
+
+// Render until the tone-mapped image is within "g_target_psnr" dB of the
+// reference's, mapped the same way for the same photon count, and report
+// the wall time and the CPU time it took. Sampling changes make each
+// photon worth more, so photons per second can't compare them, but this can.
+int render_until_converged() {
+    AccumulatorFile reference;
+    if (g_reference_pathname.empty()) {
+        std::cerr << "Need a --reference file.\n";
+        return 1;
+    }
+    if (!reference.load(g_reference_pathname)) {
+        return 1;
+    }
+
+    // Render at the reference's size.
+    Scene scene = g_scene;
+    scene.m_width = reference.m_width;
+    scene.m_height = reference.m_height;
+    scene.update();
+    int64_t pixel_count = scene.pixel_count();
+
+    // Otherwise we could never get close.
+    if (reference.m_fill_light != scene.m_fill_light) {
+        std::cerr << g_reference_pathname << ": " <<
+            (reference.m_fill_light ? "Has" : "Doesn't have") << " the fill light, but the photons " <<
+            (scene.m_fill_light ? "trace it" : "don't") << ".\n";
+        return 1;
+    }
+
+    std::cout << "Rendering until within " << g_target_psnr << " dB of " << g_reference_pathname << ".\n";
+
+    double start_cpu_seconds = cpu_seconds();
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    Scheduler scheduler(g_thread_count, worker_cpus());
+    FrameQueue queue(scene, g_sweeps, 1, g_photons, g_thread_count, g_seed,
+            g_layout, g_format, g_shared_image);
+    std::unique_ptr<FillLight> fill;
+    if (g_fill_pass > 0) {
+        fill.reset(new FillLight(scheduler, scene, g_fill_pass, g_seed));
+    }
+    start_lanes(&scheduler, &queue, g_thread_count);
+
+    // The reference, scaled to the photons so far before tone mapping,
+    // since the log curve depends on the brightness.
+    Accumulator reference_image(scene.m_width, scene.m_height, Accumulator::LAYOUT_LINEAR);
+    std::vector<const Accumulator *> reference_images(1, &reference_image);
+    float *reference_norm = new float[pixel_count*3];
+    float *image_norm = new float[pixel_count*3];
+
+    double psnr = 0;
+    int64_t photons = 0;
+    bool converged = false;
+    bool stalled = false;
+
+    // When the PSNR was last checked for progress.
+    int64_t mark_photons = 0;
+    double mark_psnr = 0;
+
+    while (!converged && !stalled && scheduler.unfinished() > 0 && !g_interrupted) {
+        sleep_while_working(scheduler, CONVERGE_CHECK_USEC);
+
+        photons = scheduler.progress();
+        if (photons == 0) {
+            continue;
+        }
+
+        std::vector<const Accumulator *> images = reduce_by_node(scheduler, scene,
+                queue.worker_images(0), queue.node_sums(0));
+        tone_map(scheduler, scene, images, fill.get(), photons, image_norm, nullptr);
+
+        reference_image.clear();
+        reference.add_to(reference_image, double(photons)/reference.m_photons);
+        tone_map(scheduler, scene, reference_images, fill.get(), photons, reference_norm, nullptr);
+
+        psnr = tone_mapped_psnr(scheduler, scene, image_norm, reference_norm);
+        converged = psnr >= g_target_psnr;
+        std::cout << photons << " photons, " << std::setprecision(3) << psnr << " dB\n";
+
+        if (mark_photons == 0) {
+            mark_photons = photons;
+            mark_psnr = psnr;
+        } else if (photons >= mark_photons*CONVERGE_STALL_FACTOR) {
+            stalled = !converged && psnr - mark_psnr < CONVERGE_STALL_DB;
+            mark_photons = photons;
+            mark_psnr = psnr;
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    double core_seconds = cpu_seconds() - start_cpu_seconds;
+
+    queue.quit();
+    scheduler.wait_idle();
+
+    if (stalled) {
+        std::cout << "Stopped improving at " << std::setprecision(3) << psnr << " dB after " <<
+            photons << " photons in " << elapsed.count() << " seconds, " << core_seconds <<
+            " core-seconds. The reference may not hold the same light as the render.\n";
+    } else if (converged) {
+        std::cout << "Converged after " << photons << " photons in " << std::setprecision(3) <<
+            elapsed.count() << " seconds, " << core_seconds << " core-seconds on " <<
+            g_thread_count << " threads.\n";
+    } else {
+        std::cout << "Stopped at " << std::setprecision(3) << psnr << " dB after " << photons <<
+            " photons in " << elapsed.count() << " seconds, " << core_seconds << " core-seconds.\n";
+    }
+
+    delete[] reference_norm;
+    delete[] image_norm;
+
+    return converged ? 0 : 1;
+}
+
+// Merge accumulator files into one, and save it and its image.
+int merge_accumulators() {
+    if (g_input_pathnames.empty()) {
+        std::cerr << "No accumulator files to merge.\n";
+        return 1;
+    }
+
+    AccumulatorFile merged;
+    if (!merged.load(g_input_pathnames[0])) {
+        return 1;
+    }
+    for (size_t i = 1; i < g_input_pathnames.size(); i++) {
+        AccumulatorFile file;
+        if (!file.load(g_input_pathnames[i]) || !merged.add(file, g_input_pathnames[i])) {
+            return 1;
+        }
+    }
+    std::cout << "Merged " << g_input_pathnames.size() << " files of " <<
+        merged.m_photons << " photons in all.\n";
+    if (merged.m_fill_light && g_fill_pass > 0) {
+        std::cerr << "The files already have the fill light.\n";
+        return 1;
+    }
+
+    std::string pathname = g_output_prefix + ".acc";
+    std::cout << "Saving to " << pathname << "\n";
+    if (!merged.save(pathname)) {
+        return 1;
+    }
+
+    Scene scene = g_scene;
+    scene.m_width = merged.m_width;
+    scene.m_height = merged.m_height;
+    Accumulator image(scene.m_width, scene.m_height, Accumulator::LAYOUT_LINEAR);
+    merged.add_to(image);
+
+    Scheduler scheduler(g_thread_count);
+    std::unique_ptr<FillLight> fill;
+    if (g_fill_pass > 0) {
+        scene.update();
+        fill.reset(new FillLight(scheduler, scene, g_fill_pass, g_seed));
+    }
+    float *image_norm = new float[scene.pixel_count()*3];
+    float *image_linear = new_linear_image(scene);
+    ToneCurve curve = tone_map(scheduler, scene, std::vector<const Accumulator *>(1, &image), fill.get(),
+            merged.m_photons, image_norm, image_linear);
+    save_image(scheduler, scene, image_norm, image_linear, curve, g_output_prefix + ".png");
+    scheduler.wait_idle();
+    delete[] image_norm;
+    delete[] image_linear;
+
+    return 0;
+}
+
+// Tone-map a saved accumulator or PFM file with each of the operators,
+// without tracing anything.
+int tone_map_file() {
+    if (g_input_pathnames.size() != 1) {
+        std::cerr << "Need one accumulator or PFM file to tone-map.\n";
+        return 1;
+    }
+    const std::string &input_pathname = g_input_pathnames[0];
+    if (g_tone_operators.empty()) {
+        g_tone_operators.push_back(TONE_LOG);
+    }
+
+    Scheduler scheduler(g_thread_count);
+    Scene scene = g_scene;
+    std::vector<float> linear;
+
+    if (input_pathname.size() > 4 && input_pathname.substr(input_pathname.size() - 4) == ".pfm") {
+        // Already has the fill pass, if it was rendered with one.
+        if (g_fill_pass > 0) {
+            std::cerr << "Can only add the fill pass to accumulator files.\n";
+            return 1;
+        }
+        if (!read_pfm(input_pathname, scene.m_width, scene.m_height, linear)) {
+            return 1;
+        }
+    } else {
+        AccumulatorFile file;
+        if (!file.load(input_pathname)) {
+            return 1;
+        }
+        if (file.m_fill_light && g_fill_pass > 0) {
+            std::cerr << input_pathname << ": Already has the fill light.\n";
+            return 1;
+        }
+        scene.m_width = file.m_width;
+        scene.m_height = file.m_height;
+        Accumulator image(scene.m_width, scene.m_height, Accumulator::LAYOUT_LINEAR);
+        file.add_to(image);
+
+        linear.resize(scene.pixel_count()*3);
+        Accumulator::add_rows_to(std::vector<const Accumulator *>(1, &image), linear.data(), 0, scene.m_height);
+        if (g_fill_pass > 0) {
+            scene.update();
+            FillLight fill(scheduler, scene, g_fill_pass, g_seed);
+            fill.add_rows_to(linear.data(), 0, scene.m_height, file.m_photons);
+        }
+    }
+
+    float *image_norm = new float[scene.pixel_count()*3];
+    for (ToneOperator op : g_tone_operators) {
+        ToneSettings settings = g_tone_settings;
+        settings.m_operator = op;
+
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+        ToneCurve curve = apply_tone_operator(scheduler, settings, linear.data(), scene.pixel_count(),
+                image_norm);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+        std::cout << "Mapped with " << tone_operator_name(op) << " in " << std::setprecision(3) <<
+            elapsed.count()*1000 << " ms.\n";
+
+        std::string pathname = g_output_prefix;
+        if (g_tone_operators.size() > 1) {
+            pathname += std::string("-") + tone_operator_name(op);
+        }
+        save_image(scheduler, scene, image_norm, linear.data(), curve, pathname + ".png");
+
+        // The encoders read "linear", and the next operator writes "image_norm".
+        scheduler.wait_idle();
+    }
+    delete[] image_norm;
+
+    return 0;
+}
+
+// Whether a "width" x "height" image fits in memory's address space: the
+// biggest buffer, a fixed64 image padded to whole tiles, must have a byte
+// count that fits, and so must its rows in an int.
+bool image_size_fits(int width, int height) {
+    const int64_t value_size = 3*sizeof(uint64_t);
+    int64_t padded_width = (int64_t(width) + TILE_SIZE - 1)/TILE_SIZE*TILE_SIZE;
+    int64_t padded_height = (int64_t(height) + TILE_SIZE - 1)/TILE_SIZE*TILE_SIZE;
+
+    return padded_width <= INT_MAX/value_size &&
+        padded_height <= PTRDIFF_MAX/value_size/padded_width;
 }
 
 void usage() {
-    std::cerr << "Usage: prism\n";
+    std::cerr << "Usage: prism [COMMAND] [options]\n";
+    std::cerr << "Commands:\n";
+    std::cerr << "    render                  Render an image or sequence (default).\n";
+    std::cerr << "    splat-bench             Compare accumulator layouts on one thread.\n";
+    std::cerr << "    merge FILE.acc...       Add up accumulator files into PREFIX.acc and PREFIX.png.\n";
+    std::cerr << "    reference               Render the average image of --photons photons without\n";
+    std::cerr << "                            randomness (slit light only).\n";
+    std::cerr << "    regress                 Compare small renders with reference files, and fail\n";
+    std::cerr << "                            if they've drifted.\n";
+    std::cerr << "    scaling                 Measure photons/s and memory bandwidth by thread\n";
+    std::cerr << "                            count and placement, and cache the fastest.\n";
+    std::cerr << "    converge                Render until the image is close to --reference, and\n";
+    std::cerr << "                            report the wall time and core-seconds.\n";
+    std::cerr << "    tonemap FILE            Tone-map an .acc or .pfm file into PREFIX.png.\n";
+    std::cerr << "Options:\n";
+    std::cerr << "    --display               Show the image in progress in a window.\n";
+    std::cerr << "    --shm NAME              Publish frames in POSIX shared memory segment NAME.\n";
+    std::cerr << "    --png-interval SECONDS  Seconds between PNG saves, 0 for none (default 60).\n";
+    std::cerr << "    --threads COUNT         Number of threads, or auto for the fastest found by\n";
+    std::cerr << "                            scaling (default one per CPU).\n";
+    std::cerr << "    --pin                   Pin threads to CPUs, NUMA node by node.\n";
+    std::cerr << "    --placement ORDER       Pinned threads take cores (one per physical core\n";
+    std::cerr << "                            first) or siblings (both of a core first).\n";
+    std::cerr << "    --layout LAYOUT         Accumulator layout, linear or tiled (default linear).\n";
+    std::cerr << "                            Only tiled updates the image in progress by tile.\n";
+    std::cerr << "    --format FORMAT         Accumulator numbers: float, fixed32, or fixed64 (default float).\n";
+    std::cerr << "    --save-acc              Also save the raw sums, for merging.\n";
+    std::cerr << "    --thumbnail FACTOR      Also save a thumbnail shrunk by FACTOR (-thumb.png).\n";
+    std::cerr << "    --png16                 Also save the image with 16 bits per sample (-16.png).\n";
+    std::cerr << "    --pfm                   Also save the linear sums as floats (.pfm).\n";
+    std::cerr << "    --shared-image          Have all threads add to one image, to save memory.\n";
+    std::cerr << "    --output PREFIX         Prefix of output image files (default out4).\n";
+    std::cerr << "    --size WIDTHxHEIGHT     Size of the output image (default 3300x4200).\n";
+    std::cerr << "    --photons COUNT         Photons per image, then stop (default unlimited).\n";
+    std::cerr << "    --seed SEED             Random seed (default 1).\n";
+    std::cerr << "    --set NAME=VALUE        Set a scene parameter.\n";
+    std::cerr << "    --light LIGHT           Light: slit, ring, or halo (default slit).\n";
+    std::cerr << "    --no-fill-light         No light from above on the prism.\n";
+    std::cerr << "    --reflections MODE      Glass reflections: stochastic, none, weighted, or\n";
+    std::cerr << "                            split (default stochastic).\n";
+    std::cerr << "    --no-reflections        Same as --reflections none.\n";
+    std::cerr << "    --fill-pass BRIGHTNESS  Render the light from above from the camera's side\n";
+    std::cerr << "                            instead, this bright (1 matches the photons).\n";
+    std::cerr << "    --perf                  Count cycles, cache misses, and so on in the tracer.\n";
+    std::cerr << "    --timeline FILE.json    Save a timeline of what each thread did, for Perfetto\n";
+    std::cerr << "                            (needs the PRISM_TIMELINE build option).\n";
+    std::cerr << "    --photon-map RADIUS     Gather photons within RADIUS pixels of each pixel\n";
+    std::cerr << "                            (1 to 64), shrinking as they come in.\n";
+    std::cerr << "    --max-bounces COUNT     Drop photons after COUNT bounces (default 64).\n";
+    std::cerr << "    --roulette-bounces N    Russian roulette after N bounces (default 4).\n";
+    std::cerr << "    --frames COUNT          Render a sequence of COUNT frames (needs --photons).\n";
+    std::cerr << "    --sweep NAME:FROM:TO    Sweep a scene parameter across the sequence.\n";
+    std::cerr << "    --references DIR        Reference files for regress (default regress).\n";
+    std::cerr << "    --update                Have regress write the reference files first.\n";
+    std::cerr << "    --tolerance DB          How far under each scene's usual PSNR regress accepts\n";
+    std::cerr << "                            (default 3).\n";
+    std::cerr << "    --reference FILE.acc    Accumulator file that converge renders towards.\n";
+    std::cerr << "    --target DB             PSNR at which converge stops (default 35).\n";
+    std::cerr << "    --operator NAME         Tonemap with log (default), reinhard, or filmic; repeat\n";
+    std::cerr << "                            for one image each (PREFIX-NAME.png).\n";
+    std::cerr << "    --exposure STOPS        Brighten tonemap's input (default 0).\n";
+    std::cerr << "    --white VALUE           Value that tonemap maps to white (default brightest).\n";
+    std::cerr << "Scene parameters are light_angle and prism_rotation (degrees) and\n";
+    std::cerr << "dispersion (multiplier of BK7's Cauchy C term, default 10).\n";
 }
 
-int main() {
-#ifdef DISPLAY
-    if (!mfb_open("ray", WIDTH, HEIGHT)) {
-        std::cerr << "Failed to open the display.\n";
+int main(int argc, char *argv[]) {
+    // Optional command before the options.
+    std::string command = "render";
+    int first_option = 1;
+    if (argc > 1 && argv[1][0] != '-') {
+        command = argv[1];
+        first_option = 2;
+    }
+    if (command != "render" && command != "splat-bench" && command != "merge" &&
+            command != "reference" && command != "regress" && command != "converge" &&
+            command != "scaling" && command != "tonemap") {
+
+        usage();
+        return 1;
+    }
+
+    for (int i = first_option; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--display") {
+            g_update_display = true;
+        } else if (arg == "--shm" && has_value) {
+            g_shm_name = argv[++i];
+            if (g_shm_name[0] != '/') {
+                g_shm_name = "/" + g_shm_name;
+            }
+        } else if (arg == "--png-interval" && has_value) {
+            g_png_interval = atoi(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            std::string threads = argv[++i];
+            if (threads == "auto") {
+                g_auto_threads = true;
+            } else {
+                g_thread_count = atoi(threads.c_str());
+                if (g_thread_count <= 0) {
+                    usage();
+                    return 1;
+                }
+            }
+        } else if (arg == "--pin") {
+            g_pin_threads = true;
+        } else if (arg == "--placement" && has_value) {
+            if (!parse_placement(argv[++i], g_placement)) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--layout" && has_value) {
+            std::string layout = argv[++i];
+            if (layout == "linear") {
+                g_layout = Accumulator::LAYOUT_LINEAR;
+            } else if (layout == "tiled") {
+                g_layout = Accumulator::LAYOUT_TILED;
+            } else {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--format" && has_value) {
+            std::string format = argv[++i];
+            if (format == "float") {
+                g_format = Accumulator::FORMAT_FLOAT;
+            } else if (format == "fixed32") {
+                g_format = Accumulator::FORMAT_FIXED32;
+            } else if (format == "fixed64") {
+                g_format = Accumulator::FORMAT_FIXED64;
+            } else {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--save-acc") {
+            g_save_accumulator = true;
+        } else if (arg == "--thumbnail" && has_value) {
+            g_thumbnail_factor = atoi(argv[++i]);
+            if (g_thumbnail_factor < 2) {
+                std::cerr << "The thumbnail factor must be at least 2.\n";
+                return 1;
+            }
+        } else if (arg == "--png16") {
+            g_save_png16 = true;
+        } else if (arg == "--pfm") {
+            g_save_pfm = true;
+        } else if (arg == "--shared-image") {
+            g_shared_image = true;
+        } else if (arg == "--output" && has_value) {
+            g_output_prefix = argv[++i];
+        } else if (arg == "--size" && has_value) {
+            if (sscanf(argv[++i], "%dx%d", &g_scene.m_width, &g_scene.m_height) != 2 ||
+                    g_scene.m_width <= 0 || g_scene.m_height <= 0) {
+
+                usage();
+                return 1;
+            }
+            if (!image_size_fits(g_scene.m_width, g_scene.m_height)) {
+                std::cerr << "An image of " << argv[i] << " pixels is too big.\n";
+                return 1;
+            }
+        } else if (arg == "--photons" && has_value) {
+            // Allow "1e9".
+            g_photons = (int64_t) atof(argv[++i]);
+        } else if (arg == "--seed" && has_value) {
+            g_seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--set" && has_value) {
+            std::string setting = argv[++i];
+            size_t equals = setting.find('=');
+            if (equals == std::string::npos ||
+                    !g_scene.set(setting.substr(0, equals), atof(setting.c_str() + equals + 1))) {
+
+                usage();
+                return 1;
+            }
+        } else if (arg == "--light" && has_value) {
+            if (!g_scene.set_light(argv[++i])) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--no-fill-light") {
+            g_scene.m_fill_light = false;
+        } else if (arg == "--reflections" && has_value) {
+            if (!g_scene.set_reflections(argv[++i])) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--no-reflections") {
+            g_scene.m_reflections = Scene::REFLECTIONS_NONE;
+        } else if (arg == "--fill-pass" && has_value) {
+            g_fill_pass = atof(argv[++i]);
+            if (g_fill_pass <= 0) {
+                usage();
+                return 1;
+            }
+            g_scene.m_fill_light = false;
+        } else if (arg == "--perf") {
+            g_perf_counters = true;
+        } else if (arg == "--timeline" && has_value) {
+            g_timeline_pathname = argv[++i];
+        } else if (arg == "--photon-map" && has_value) {
+            g_photon_radius = atof(argv[++i]);
+            if (g_photon_radius < MIN_PHOTON_RADIUS || g_photon_radius > MAX_PHOTON_RADIUS) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--max-bounces" && has_value) {
+            g_scene.m_max_bounces = atoi(argv[++i]);
+            if (g_scene.m_max_bounces < 0) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--roulette-bounces" && has_value) {
+            g_scene.m_roulette_bounces = atoi(argv[++i]);
+            if (g_scene.m_roulette_bounces < 0) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--frames" && has_value) {
+            g_frame_count = atoi(argv[++i]);
+        } else if (arg == "--sweep" && has_value) {
+            SceneSweep sweep;
+            if (!parse_sweep(argv[++i], sweep)) {
+                usage();
+                return 1;
+            }
+            g_sweeps.push_back(sweep);
+        } else if (arg == "--references" && has_value) {
+            g_reference_directory = argv[++i];
+        } else if (arg == "--update") {
+            g_update_references = true;
+        } else if (arg == "--tolerance" && has_value) {
+            g_tolerance = atof(argv[++i]);
+        } else if (arg == "--reference" && has_value) {
+            g_reference_pathname = argv[++i];
+        } else if (arg == "--target" && has_value) {
+            g_target_psnr = atof(argv[++i]);
+        } else if (arg == "--operator" && has_value) {
+            ToneOperator op;
+            if (!parse_tone_operator(argv[++i], op)) {
+                usage();
+                return 1;
+            }
+            g_tone_operators.push_back(op);
+        } else if (arg == "--exposure" && has_value) {
+            g_tone_settings.m_exposure = atof(argv[++i]);
+        } else if (arg == "--white" && has_value) {
+            g_tone_settings.m_white = atof(argv[++i]);
+        } else if ((command == "merge" || command == "tonemap") && arg[0] != '-') {
+            g_input_pathnames.push_back(arg);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    g_scene.update();
+
+    if (!g_timeline_pathname.empty()) {
+#ifdef TIMELINE
+        if (g_perf_counters) {
+            std::cerr << "Can't profile with both --perf and --timeline.\n";
+            return 1;
+        }
+        timeline_start();
+        atexit(save_timeline);
+#else
+        std::cerr << "Built without timeline support.\n";
+        return 1;
+#endif
+    }
+
+    if (g_perf_counters) {
+        g_tracer = profiled_tracer_for(g_scene, g_layout, g_shared_image);
+    } else if (!g_timeline_pathname.empty()) {
+        g_tracer = timed_tracer_for(g_scene, g_layout, g_shared_image);
+    } else {
+        g_tracer = tracer_for(g_scene, g_layout, g_shared_image);
+    }
+
+    if (command == "splat-bench") {
+        benchmark_splats(g_scene, g_photons < 0 ? 2000000 : g_photons, g_seed);
+        return 0;
+    }
+
+    g_topology = Topology::detect();
+
+    if (command == "scaling") {
+        ThreadConfig config = run_scaling_sweep(g_scene, g_topology, g_layout, g_format, g_seed);
+        if (!save_thread_config(g_topology, config)) {
+            return 1;
+        }
+        std::cout << "Saved to " << thread_config_pathname() << "\n";
+        return 0;
+    }
+
+    if (g_auto_threads) {
+        ThreadConfig config;
+        if (!load_thread_config(g_topology, config)) {
+            std::cout << "No thread count cached for this machine, measuring.\n";
+            config = run_scaling_sweep(g_scene, g_topology, g_layout, g_format, g_seed);
+            save_thread_config(g_topology, config);
+        }
+        g_thread_count = config.m_threads;
+        g_placement = config.m_placement;
+        g_pin_threads = true;
+    } else if (g_thread_count == 0) {
+        g_thread_count = std::thread::hardware_concurrency();
+    }
+    std::cout << "Using " << g_thread_count << " threads.\n";
+
+    if (g_pin_threads) {
+        g_worker_nodes = g_topology.worker_nodes(g_thread_count);
+        std::cout << "Pinning threads across " << g_topology.node_count() << " NUMA nodes.\n";
+    }
+
+    if (command == "merge") {
+        return merge_accumulators();
+    }
+    if (command == "tonemap") {
+        return tone_map_file();
+    }
+    if (command == "reference") {
+        return render_reference();
+    }
+    if (command == "regress") {
+        return run_regression(g_reference_directory, g_update_references, g_tolerance,
+                g_thread_count) ? 0 : 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (command == "converge") {
+        return render_until_converged();
+    }
+
+    if (g_photons == 0 || (g_frame_count > 0 && g_photons < 0)) {
+        std::cerr << "Need a positive --photons count.\n";
+        return 1;
+    }
+
+    if (g_photon_radius > 0) {
+        if (g_frame_count > 0 || g_update_display || !g_shm_name.empty()) {
+            std::cerr << "The photon map only renders single frames to files.\n";
+            return 1;
+        }
+        render_photon_map();
+        return 0;
+    }
+
+    if (g_frame_count > 0) {
+        render_sequence();
         return 0;
     }
+
+    if (g_update_display) {
+#ifdef DISPLAY
+        if (!mfb_open("ray", g_scene.m_width, g_scene.m_height)) {
+            std::cerr << "Failed to open the display.\n";
+            return 0;
+        }
+#else
+        std::cerr << "Built without display support.\n";
+        return 1;
 #endif
+    }
 
     render_frame();
 
+#ifdef DISPLAY
+    if (g_update_display) {
+        mfb_close();
+    }
+#endif
+
     return 0;
 }
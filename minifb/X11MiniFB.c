@@ -0,0 +1,288 @@
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MiniFB.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Size of the square tiles (in window pixels) that we compare and upload independently.
+#define TILE_SIZE 32
+
+static Display* s_display;
+static int s_screen;
+static Window s_window;
+static GC s_gc;
+static XImage* s_image;
+static Atom s_delete_window;
+
+// Size of the caller's buffer.
+static int s_width;
+static int s_height;
+
+// Number of buffer pixels per window pixel in each direction. Large images are
+// box-filtered down so that they fit on the screen.
+static int s_scale;
+static int s_window_width;
+static int s_window_height;
+
+// Copy of the last buffer we were given, to find tiles that changed.
+static unsigned int* s_previous;
+
+// Window-sized pixels backing s_image.
+static unsigned int* s_pixels;
+
+// Whether the next update must upload every tile (first frame, expose).
+static int s_redraw_all;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int mfb_open(const char* name, int width, int height)
+{
+	XSetWindowAttributes attributes;
+	XSizeHints hints;
+	Visual* visual;
+	int depth;
+	int max_width;
+	int max_height;
+
+	s_display = XOpenDisplay(0);
+	if (!s_display)
+		return 0;
+
+	s_screen = DefaultScreen(s_display);
+	visual = DefaultVisual(s_display, s_screen);
+	depth = DefaultDepth(s_display, s_screen);
+
+	// We only write 32-bit xRGB pixels.
+	if (depth != 24 && depth != 32)
+	{
+		XCloseDisplay(s_display);
+		s_display = 0;
+		return 0;
+	}
+
+	s_width = width;
+	s_height = height;
+
+	// Shrink by an integer factor until we fit in most of the screen.
+	max_width = DisplayWidth(s_display, s_screen)*9/10;
+	max_height = DisplayHeight(s_display, s_screen)*9/10;
+	s_scale = 1;
+	while (width/s_scale > max_width || height/s_scale > max_height)
+		s_scale++;
+	s_window_width = width/s_scale;
+	s_window_height = height/s_scale;
+
+	s_previous = (unsigned int*) calloc((size_t) width*height, sizeof(unsigned int));
+	s_pixels = (unsigned int*) calloc((size_t) s_window_width*s_window_height, sizeof(unsigned int));
+	if (!s_previous || !s_pixels)
+	{
+		mfb_close();
+		return 0;
+	}
+
+	attributes.background_pixel = BlackPixel(s_display, s_screen);
+	attributes.event_mask = ExposureMask | KeyPressMask;
+	s_window = XCreateWindow(s_display, RootWindow(s_display, s_screen),
+		0, 0, s_window_width, s_window_height, 0, depth, InputOutput, visual,
+		CWBackPixel | CWEventMask, &attributes);
+	if (!s_window)
+	{
+		mfb_close();
+		return 0;
+	}
+
+	XStoreName(s_display, s_window, name);
+
+	// Don't let the window manager resize us.
+	hints.flags = PMinSize | PMaxSize;
+	hints.min_width = hints.max_width = s_window_width;
+	hints.min_height = hints.max_height = s_window_height;
+	XSetWMNormalHints(s_display, s_window, &hints);
+
+	// Get told when the user closes the window.
+	s_delete_window = XInternAtom(s_display, "WM_DELETE_WINDOW", False);
+	XSetWMProtocols(s_display, s_window, &s_delete_window, 1);
+
+	s_gc = XCreateGC(s_display, s_window, 0, 0);
+	s_image = XCreateImage(s_display, visual, depth, ZPixmap, 0, (char*) s_pixels,
+		s_window_width, s_window_height, 32, s_window_width*4);
+	if (!s_image)
+	{
+		mfb_close();
+		return 0;
+	}
+
+	XMapRaised(s_display, s_window);
+	XFlush(s_display);
+
+	s_redraw_all = 1;
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void mfb_close()
+{
+	if (s_image)
+	{
+		// We own the pixels, don't let Xlib free them.
+		s_image->data = 0;
+		XDestroyImage(s_image);
+		s_image = 0;
+	}
+
+	if (s_display)
+	{
+		if (s_gc)
+			XFreeGC(s_display, s_gc);
+		if (s_window)
+			XDestroyWindow(s_display, s_window);
+		XCloseDisplay(s_display);
+	}
+
+	s_display = 0;
+	s_window = 0;
+	s_gc = 0;
+
+	free(s_previous);
+	free(s_pixels);
+	s_previous = 0;
+	s_pixels = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int updateEvents()
+{
+	int state = 0;
+
+	while (XPending(s_display))
+	{
+		XEvent event;
+		XNextEvent(s_display, &event);
+
+		switch (event.type)
+		{
+			case KeyPress:
+			{
+				if (XLookupKeysym(&event.xkey, 0) == XK_Escape)
+					state = -1;
+				break;
+			}
+
+			case ClientMessage:
+			{
+				if ((Atom) event.xclient.data.l[0] == s_delete_window)
+					state = -1;
+				break;
+			}
+
+			case Expose:
+			{
+				s_redraw_all = 1;
+				break;
+			}
+		}
+	}
+
+	return state;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Whether the buffer pixels under this window tile differ from what we last uploaded.
+// Also updates our copy of them.
+static int tileChanged(const unsigned int* buffer, int x0, int y0, int w, int h)
+{
+	int changed = 0;
+	int sx = x0*s_scale;
+	int sw = w*s_scale*sizeof(unsigned int);
+	int y;
+
+	for (y = y0*s_scale; y < (y0 + h)*s_scale; y++)
+	{
+		const unsigned int* src = buffer + (size_t) y*s_width + sx;
+		unsigned int* old = s_previous + (size_t) y*s_width + sx;
+
+		if (memcmp(src, old, sw) != 0)
+		{
+			memcpy(old, src, sw);
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Box-filter the buffer pixels under this window tile into s_pixels.
+static void filterTile(const unsigned int* buffer, int x0, int y0, int w, int h)
+{
+	int count = s_scale*s_scale;
+	int x, y, i, j;
+
+	for (y = y0; y < y0 + h; y++)
+	{
+		unsigned int* dst = s_pixels + (size_t) y*s_window_width;
+
+		for (x = x0; x < x0 + w; x++)
+		{
+			unsigned int r = 0, g = 0, b = 0;
+
+			for (j = 0; j < s_scale; j++)
+			{
+				const unsigned int* src = buffer + (size_t) (y*s_scale + j)*s_width + x*s_scale;
+
+				for (i = 0; i < s_scale; i++)
+				{
+					r += (src[i] >> 16) & 0xFF;
+					g += (src[i] >> 8) & 0xFF;
+					b += src[i] & 0xFF;
+				}
+			}
+
+			dst[x] = MFB_RGB(r/count, g/count, b/count);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int mfb_update(void* buffer)
+{
+	const unsigned int* pixels = (const unsigned int*) buffer;
+	int x, y;
+
+	if (!s_display)
+		return -1;
+
+	if (updateEvents() < 0)
+		return -1;
+
+	// Only convert and send the tiles that changed since last time.
+	for (y = 0; y < s_window_height; y += TILE_SIZE)
+	{
+		int h = s_window_height - y < TILE_SIZE ? s_window_height - y : TILE_SIZE;
+
+		for (x = 0; x < s_window_width; x += TILE_SIZE)
+		{
+			int w = s_window_width - x < TILE_SIZE ? s_window_width - x : TILE_SIZE;
+
+			if (tileChanged(pixels, x, y, w, h) || s_redraw_all)
+			{
+				filterTile(pixels, x, y, w, h);
+				XPutImage(s_display, s_window, s_gc, s_image, x, y, x, y, w, h);
+			}
+		}
+	}
+
+	s_redraw_all = 0;
+	XFlush(s_display);
+
+	return 0;
+}